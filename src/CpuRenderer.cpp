@@ -0,0 +1,913 @@
+#include "CpuRenderer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define CPU_RENDERER_AVX
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CPU_RENDERER_SSE
+#endif
+
+// The shader's slab test uses fma, AVX2 targets have it too
+#if defined(__FMA__) || defined(__AVX2__)
+#define CPU_RENDERER_FMA
+#endif
+
+namespace
+{
+    // Constants of raytracer.comp
+    const float EPSILON = 0.0001f;
+    const float MAXLEN = 10000.0f;
+    const float INF = std::numeric_limits<float>::infinity();
+
+    //  Reciprocal of the ray direction and origin * reciprocal, zero components replaced by a tiny value of the same sign
+    struct RayInv
+    {
+        float invDir[4];
+        float originTimesInv[4];
+    };
+
+    RayInv makeRayInv(const glm::vec4 &rayO, const glm::vec4 &rayD)
+    {
+        RayInv rayInv;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float dirSign = rayD[axis] >= 0.0f ? 1.0f : -1.0f;
+            rayInv.invDir[axis] = dirSign / std::max(std::abs(rayD[axis]), 1e-20f);
+            rayInv.originTimesInv[axis] = rayO[axis] * rayInv.invDir[axis];
+        }
+        rayInv.invDir[3] = 0.0f;
+        rayInv.originTimesInv[3] = 0.0f;
+        return rayInv;
+    }
+
+#ifdef CPU_RENDERER_SSE
+    //  Lane 3 of the node vectors holds the child and count bits, it is replaced so it never wins the reductions
+    inline __m128 slabNear(__m128 t0, __m128 t1)
+    {
+        const __m128 xyzMask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+        const __m128 wNegInf = _mm_set_ps(-INF, 0.0f, 0.0f, 0.0f);
+        return _mm_or_ps(_mm_and_ps(_mm_min_ps(t0, t1), xyzMask), wNegInf);
+    }
+
+    inline __m128 slabFar(__m128 t0, __m128 t1)
+    {
+        const __m128 xyzMask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+        const __m128 wPosInf = _mm_set_ps(INF, 0.0f, 0.0f, 0.0f);
+        return _mm_or_ps(_mm_and_ps(_mm_max_ps(t0, t1), xyzMask), wPosInf);
+    }
+
+    inline float horizontalMax(__m128 v)
+    {
+        v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+        v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+        return _mm_cvtss_f32(v);
+    }
+
+    inline float horizontalMin(__m128 v)
+    {
+        v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+        v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+        return _mm_cvtss_f32(v);
+    }
+
+    inline __m128 slabPlanes(__m128 bound, __m128 invDir, __m128 originTimesInv)
+    {
+#ifdef CPU_RENDERER_FMA
+        return _mm_fmsub_ps(bound, invDir, originTimesInv);
+#else
+        return _mm_sub_ps(_mm_mul_ps(bound, invDir), originTimesInv);
+#endif
+    }
+
+    inline float slabResult(__m128 t0, __m128 t1)
+    {
+        float tmin = horizontalMax(slabNear(t0, t1));
+        float tmax = horizontalMin(slabFar(t0, t1));
+        return (tmin <= tmax && tmax >= 0.0f) ? tmin : INF;
+    }
+#endif
+
+    //  Entry t of the ray into the box, INF if it misses the box or the box is behind it
+    float intersectAABB(const RayInv &rayInv, const Primitives::NodeTLAS &node)
+    {
+#ifdef CPU_RENDERER_SSE
+        __m128 invDir = _mm_loadu_ps(rayInv.invDir);
+        __m128 originTimesInv = _mm_loadu_ps(rayInv.originTimesInv);
+        __m128 t0 = slabPlanes(_mm_loadu_ps(&node.first.x), invDir, originTimesInv);
+        __m128 t1 = slabPlanes(_mm_loadu_ps(&node.second.x), invDir, originTimesInv);
+        return slabResult(t0, t1);
+#else
+        float tmin = -INF;
+        float tmax = INF;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float t0 = std::fma(node.first[axis], rayInv.invDir[axis], -rayInv.originTimesInv[axis]);
+            float t1 = std::fma(node.second[axis], rayInv.invDir[axis], -rayInv.originTimesInv[axis]);
+            tmin = std::max(tmin, std::min(t0, t1));
+            tmax = std::min(tmax, std::max(t0, t1));
+        }
+        return (tmin <= tmax && tmax >= 0.0f) ? tmin : INF;
+#endif
+    }
+
+    //  Both children of an interior node, with AVX in one pass of 8 lanes
+    void intersectChildren(const RayInv &rayInv, const Primitives::NodeTLAS &a, const Primitives::NodeTLAS &b, float &tA, float &tB)
+    {
+#ifdef CPU_RENDERER_AVX
+        __m256 invDir = _mm256_broadcast_ps((const __m128 *)rayInv.invDir);
+        __m256 originTimesInv = _mm256_broadcast_ps((const __m128 *)rayInv.originTimesInv);
+        __m256 lo = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(&a.first.x)), _mm_loadu_ps(&b.first.x), 1);
+        __m256 hi = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(&a.second.x)), _mm_loadu_ps(&b.second.x), 1);
+#ifdef CPU_RENDERER_FMA
+        __m256 t0 = _mm256_fmsub_ps(lo, invDir, originTimesInv);
+        __m256 t1 = _mm256_fmsub_ps(hi, invDir, originTimesInv);
+#else
+        __m256 t0 = _mm256_sub_ps(_mm256_mul_ps(lo, invDir), originTimesInv);
+        __m256 t1 = _mm256_sub_ps(_mm256_mul_ps(hi, invDir), originTimesInv);
+#endif
+        tA = slabResult(_mm256_castps256_ps128(t0), _mm256_castps256_ps128(t1));
+        tB = slabResult(_mm256_extractf128_ps(t0, 1), _mm256_extractf128_ps(t1, 1));
+#else
+        tA = intersectAABB(rayInv, a);
+        tB = intersectAABB(rayInv, b);
+#endif
+    }
+
+#ifdef CPU_RENDERER_SSE
+    //  Four children of a wide node from their per-axis bounds, same operations as intersectAABB lane by lane
+    template <uint32_t N>
+    inline __m128 intersectWideGroup(const RayInv &rayInv, const Primitives::NodeWide<N> &node, uint32_t lane)
+    {
+        __m128 invX = _mm_set1_ps(rayInv.invDir[0]), invY = _mm_set1_ps(rayInv.invDir[1]), invZ = _mm_set1_ps(rayInv.invDir[2]);
+        __m128 otiX = _mm_set1_ps(rayInv.originTimesInv[0]), otiY = _mm_set1_ps(rayInv.originTimesInv[1]), otiZ = _mm_set1_ps(rayInv.originTimesInv[2]);
+
+        __m128 tx0 = slabPlanes(_mm_loadu_ps(node.minX + lane), invX, otiX);
+        __m128 tx1 = slabPlanes(_mm_loadu_ps(node.maxX + lane), invX, otiX);
+        __m128 ty0 = slabPlanes(_mm_loadu_ps(node.minY + lane), invY, otiY);
+        __m128 ty1 = slabPlanes(_mm_loadu_ps(node.maxY + lane), invY, otiY);
+        __m128 tz0 = slabPlanes(_mm_loadu_ps(node.minZ + lane), invZ, otiZ);
+        __m128 tz1 = slabPlanes(_mm_loadu_ps(node.maxZ + lane), invZ, otiZ);
+
+        __m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_min_ps(tz0, tz1));
+        __m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_max_ps(tz0, tz1));
+        __m128 hit = _mm_and_ps(_mm_cmple_ps(tNear, tFar), _mm_cmpge_ps(tFar, _mm_setzero_ps()));
+
+        return _mm_or_ps(_mm_and_ps(hit, tNear), _mm_andnot_ps(hit, _mm_set1_ps(INF)));
+    }
+#endif
+
+#ifdef CPU_RENDERER_AVX
+    inline __m256 slabPlanes8(__m256 bound, __m256 invDir, __m256 originTimesInv)
+    {
+#ifdef CPU_RENDERER_FMA
+        return _mm256_fmsub_ps(bound, invDir, originTimesInv);
+#else
+        return _mm256_sub_ps(_mm256_mul_ps(bound, invDir), originTimesInv);
+#endif
+    }
+
+    inline __m256 intersectWide8(const RayInv &rayInv, const Primitives::NodeWide<8> &node)
+    {
+        __m256 invX = _mm256_set1_ps(rayInv.invDir[0]), invY = _mm256_set1_ps(rayInv.invDir[1]), invZ = _mm256_set1_ps(rayInv.invDir[2]);
+        __m256 otiX = _mm256_set1_ps(rayInv.originTimesInv[0]), otiY = _mm256_set1_ps(rayInv.originTimesInv[1]), otiZ = _mm256_set1_ps(rayInv.originTimesInv[2]);
+
+        __m256 tx0 = slabPlanes8(_mm256_loadu_ps(node.minX), invX, otiX);
+        __m256 tx1 = slabPlanes8(_mm256_loadu_ps(node.maxX), invX, otiX);
+        __m256 ty0 = slabPlanes8(_mm256_loadu_ps(node.minY), invY, otiY);
+        __m256 ty1 = slabPlanes8(_mm256_loadu_ps(node.maxY), invY, otiY);
+        __m256 tz0 = slabPlanes8(_mm256_loadu_ps(node.minZ), invZ, otiZ);
+        __m256 tz1 = slabPlanes8(_mm256_loadu_ps(node.maxZ), invZ, otiZ);
+
+        __m256 tNear = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)), _mm256_min_ps(tz0, tz1));
+        __m256 tFar = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)), _mm256_max_ps(tz0, tz1));
+        __m256 hit = _mm256_and_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ), _mm256_cmp_ps(tFar, _mm256_setzero_ps(), _CMP_GE_OQ));
+
+        return _mm256_blendv_ps(_mm256_set1_ps(INF), tNear, hit);
+    }
+#endif
+
+    //  Entry t into every child box of a wide node, INF for missed boxes and unused slots
+    template <uint32_t N>
+    void intersectWideNode(const RayInv &rayInv, const Primitives::NodeWide<N> &node, float t[N])
+    {
+#ifdef CPU_RENDERER_AVX
+        if constexpr (N == 8)
+        {
+            _mm256_storeu_ps(t, intersectWide8(rayInv, node));
+            return;
+        }
+#endif
+#ifdef CPU_RENDERER_SSE
+        for (uint32_t lane = 0; lane < N; lane += 4)
+        {
+            _mm_storeu_ps(t + lane, intersectWideGroup(rayInv, node, lane));
+        }
+#else
+        for (uint32_t lane = 0; lane < N; lane++)
+        {
+            Primitives::NodeTLAS box{glm::vec4(node.minX[lane], node.minY[lane], node.minZ[lane], 0.0f), glm::vec4(node.maxX[lane], node.maxY[lane], node.maxZ[lane], 0.0f)};
+            t[lane] = intersectAABB(rayInv, box);
+        }
+#endif
+    }
+
+    //  Möller-Trumbore on up to four triangles at once in the shader's order of operations, t is -1 where a triangle is missed
+    void intersectTriangles(const glm::vec4 &rayO, const glm::vec4 &rayD, const Primitives::NodeBLAS *triangles, uint32_t count, float t[4], glm::vec2 uv[4])
+    {
+#ifdef CPU_RENDERER_SSE
+        // Transpose to one register per coordinate, missing lanes repeat the last triangle
+        float soa[9][4];
+        for (uint32_t lane = 0; lane < 4; lane++)
+        {
+            const Primitives::NodeBLAS &triangle = triangles[std::min(lane, count - 1)];
+            for (int axis = 0; axis < 3; axis++)
+            {
+                soa[axis][lane] = triangle.point1[axis];
+                soa[3 + axis][lane] = triangle.point2[axis] - triangle.point1[axis];
+                soa[6 + axis][lane] = triangle.point3[axis] - triangle.point1[axis];
+            }
+        }
+
+        __m128 e1x = _mm_loadu_ps(soa[3]), e1y = _mm_loadu_ps(soa[4]), e1z = _mm_loadu_ps(soa[5]);
+        __m128 e2x = _mm_loadu_ps(soa[6]), e2y = _mm_loadu_ps(soa[7]), e2z = _mm_loadu_ps(soa[8]);
+        __m128 dx = _mm_set1_ps(rayD.x), dy = _mm_set1_ps(rayD.y), dz = _mm_set1_ps(rayD.z);
+
+        __m128 cx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 cy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 cz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, cx), _mm_mul_ps(e1y, cy)), _mm_mul_ps(e1z, cz));
+
+        const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.0f);
+        __m128 miss = _mm_cmplt_ps(_mm_and_ps(det, absMask), _mm_set1_ps(EPSILON));
+
+        __m128 f = _mm_div_ps(one, det);
+        __m128 sx = _mm_sub_ps(_mm_set1_ps(rayO.x), _mm_loadu_ps(soa[0]));
+        __m128 sy = _mm_sub_ps(_mm_set1_ps(rayO.y), _mm_loadu_ps(soa[1]));
+        __m128 sz = _mm_sub_ps(_mm_set1_ps(rayO.z), _mm_loadu_ps(soa[2]));
+
+        __m128 u = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, cx), _mm_mul_ps(sy, cy)), _mm_mul_ps(sz, cz)));
+        miss = _mm_or_ps(miss, _mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmpgt_ps(u, one)));
+
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+
+        __m128 v = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)));
+        miss = _mm_or_ps(miss, _mm_or_ps(_mm_cmplt_ps(v, zero), _mm_cmpgt_ps(_mm_add_ps(u, v), one)));
+
+        __m128 hitT = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)));
+        hitT = _mm_or_ps(_mm_and_ps(miss, _mm_set1_ps(-1.0f)), _mm_andnot_ps(miss, hitT));
+
+        float us[4], vs[4];
+        _mm_storeu_ps(t, hitT);
+        _mm_storeu_ps(us, u);
+        _mm_storeu_ps(vs, v);
+        for (uint32_t lane = 0; lane < 4; lane++)
+        {
+            uv[lane] = glm::vec2(us[lane], vs[lane]);
+        }
+#else
+        for (uint32_t lane = 0; lane < count; lane++)
+        {
+            const Primitives::NodeBLAS &triangle = triangles[lane];
+            glm::vec3 e1 = glm::vec3(triangle.point2 - triangle.point1);
+            glm::vec3 e2 = glm::vec3(triangle.point3 - triangle.point1);
+
+            t[lane] = -1.0f;
+
+            glm::vec3 dirCrossE2 = glm::cross(glm::vec3(rayD), e2);
+            float det = glm::dot(e1, dirCrossE2);
+            if (std::abs(det) < EPSILON)
+            {
+                continue;
+            }
+
+            float f = 1.0f / det;
+            glm::vec3 p1ToOrigin = glm::vec3(rayO - triangle.point1);
+            uv[lane].x = f * glm::dot(p1ToOrigin, dirCrossE2);
+            if (uv[lane].x < 0 || uv[lane].x > 1)
+            {
+                continue;
+            }
+
+            glm::vec3 originCrossE1 = glm::cross(p1ToOrigin, e1);
+            uv[lane].y = f * glm::dot(glm::vec3(rayD), originCrossE1);
+            if (uv[lane].y < 0 || (uv[lane].x + uv[lane].y) > 1)
+            {
+                continue;
+            }
+            t[lane] = f * glm::dot(e2, originCrossE1);
+        }
+#endif
+    }
+
+    float sphereIntersect(const glm::vec4 &rayO, const glm::vec4 &rayD)
+    {
+        glm::vec4 sphereToRay = rayO - glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+        float a = glm::dot(rayD, rayD);
+        float b = 2 * glm::dot(rayD, sphereToRay);
+        float c = glm::dot(sphereToRay, sphereToRay) - 1.0f;
+        float discriminant = b * b - 4 * a * c;
+
+        if (discriminant < 0)
+        {
+            return -1.0f;
+        }
+
+        float t1 = (-b - std::sqrt(discriminant)) / (2.0f * a);
+        float t2 = (-b + std::sqrt(discriminant)) / (2.0f * a);
+
+        return t1 < t2 ? t1 : t2;
+    }
+
+    float planeIntersect(const glm::vec4 &rayO, const glm::vec4 &rayD)
+    {
+        if (std::abs(rayD.y) < EPSILON)
+        {
+            return -1.0f;
+        }
+
+        return -rayO.y / rayD.y;
+    }
+
+    float shapeIntersect(const Primitives::Shape &shape, const glm::vec4 &rayO, const glm::vec4 &rayD)
+    {
+        glm::vec4 nRayO = shape.inverseTransform * rayO;
+        glm::vec4 nRayD = shape.inverseTransform * rayD;
+
+        if (shape.typeEnum == 0)
+        {
+            return sphereIntersect(nRayO, nRayD);
+        }
+        if (shape.typeEnum == 1)
+        {
+            return planeIntersect(nRayO, nRayD);
+        }
+        return -1.0f;
+    }
+
+    glm::vec4 reflect(const glm::vec4 &incident, const glm::vec4 &normal)
+    {
+        return incident - 2.0f * glm::dot(normal, incident) * normal;
+    }
+
+    struct HitParams
+    {
+        glm::vec4 point;
+        glm::vec4 normalv;
+        glm::vec4 eyev;
+        glm::vec4 overPoint;
+    };
+
+    HitParams getHitParams(const glm::vec4 &rayO, const glm::vec4 &rayD, float t, const glm::mat4 &inverseTransform, uint32_t typeEnum, const glm::vec4 &n1, const glm::vec4 &n2, const glm::vec4 &n3, const glm::vec2 &uv)
+    {
+        HitParams hitParams;
+        hitParams.point = rayO + glm::normalize(rayD) * t;
+
+        glm::vec4 n(0.0f);
+        glm::vec4 objectPoint = inverseTransform * hitParams.point;
+        if (typeEnum == 0)
+        {
+            n = objectPoint - glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+        }
+        else if (typeEnum == 1)
+        {
+            n = glm::vec4(0.0f, 1.0f, 0.0f, 0.0f);
+        }
+        else if (typeEnum == 2)
+        {
+            n = n2 * uv.x + n3 * uv.y + n1 * (1.0f - uv.x - uv.y);
+            n.w = 0.0f;
+        }
+
+        hitParams.normalv = glm::transpose(inverseTransform) * n;
+        hitParams.normalv.w = 0.0f;
+        hitParams.normalv = glm::normalize(hitParams.normalv);
+        hitParams.eyev = -rayD;
+
+        if (glm::dot(hitParams.normalv, hitParams.eyev) < 0)
+        {
+            hitParams.normalv = -hitParams.normalv;
+        }
+
+        hitParams.overPoint = hitParams.point + hitParams.normalv * EPSILON;
+        return hitParams;
+    }
+
+    glm::vec4 lighting(const Primitives::Material &material, const glm::vec4 &lightPos, const HitParams &hitParams, bool shadowed)
+    {
+        glm::vec4 intensity(1.0f);
+        glm::vec4 effectiveColour = intensity * material.colour;
+        glm::vec4 ambient = effectiveColour * material.ambient;
+        if (shadowed)
+        {
+            return ambient;
+        }
+
+        glm::vec4 diffuse(0.0f, 0.0f, 0.0f, 1.0f);
+        glm::vec4 specular(0.0f, 0.0f, 0.0f, 1.0f);
+
+        glm::vec4 lightv = glm::normalize(lightPos - hitParams.overPoint);
+        float lightDotNormal = glm::dot(lightv, hitParams.normalv);
+        if (lightDotNormal >= 0)
+        {
+            diffuse = effectiveColour * material.diffuse * lightDotNormal;
+
+            float reflectDotEye = glm::dot(reflect(-lightv, hitParams.normalv), hitParams.eyev);
+            if (reflectDotEye > 0)
+            {
+                specular = intensity * material.specular * std::pow(reflectDotEye, material.shininess);
+            }
+        }
+
+        return ambient + diffuse + specular;
+    }
+} // namespace
+
+CpuRenderer::CpuRenderer(ThreadPool &pool) : pool(pool)
+{
+}
+
+void CpuRenderer::setScene(const Primitives::Shape *sceneShapes, size_t sceneShapeCount, const Primitives::BVHBuffers &buffers)
+{
+    shapes = sceneShapes;
+    shapeCount = sceneShapeCount;
+    bvh = buffers.bvh;
+    nodeWidth = bvh ? bvh->nodeWidth : 2;
+    compressed = bvh && bvh->compressed != 0;
+    tlasNodeCount = buffers.bvhSize > offsetof(Primitives::BVH, TLAS)
+                        ? (buffers.bvhSize - offsetof(Primitives::BVH, TLAS)) / Primitives::tlasNodeSize(nodeWidth, compressed)
+                        : 0;
+    triangles = buffers.triangles;
+    positions = buffers.positions;
+    normals = buffers.normals;
+}
+
+void CpuRenderer::render(const glm::vec4 &lightPos, const Primitives::Camera &camera, void *output, bool packed, bool tonemap) const
+{
+    uint32_t tilesX = (camera.width + TILE_SIZE - 1) / TILE_SIZE;
+    uint32_t tilesY = (camera.height + TILE_SIZE - 1) / TILE_SIZE;
+
+    pool.parallelFor(0, tilesX * tilesY, 1, [&](uint32_t tileBegin, uint32_t tileEnd) {
+        for (uint32_t tile = tileBegin; tile < tileEnd; tile++)
+        {
+            uint32_t x0 = (tile % tilesX) * TILE_SIZE;
+            uint32_t y0 = (tile / tilesX) * TILE_SIZE;
+
+            for (uint32_t y = y0; y < std::min(y0 + TILE_SIZE, camera.height); y++)
+            {
+                for (uint32_t x = x0; x < std::min(x0 + TILE_SIZE, camera.width); x++)
+                {
+                    glm::vec4 colour = renderPixel(lightPos, camera, x, y);
+                    size_t pixelIdx = size_t(camera.width) * y + x;
+
+                    if (!packed)
+                    {
+                        static_cast<glm::vec4 *>(output)[pixelIdx] = colour;
+                        continue;
+                    }
+
+                    if (tonemap)
+                    {
+                        glm::vec3 rgb = glm::vec3(colour);
+                        colour = glm::vec4(rgb / (glm::vec3(1.0f) + rgb), colour.a);
+                    }
+                    static_cast<uint32_t *>(output)[pixelIdx] = packUnorm4x8(colour);
+                }
+            }
+        }
+    });
+}
+
+glm::vec4 CpuRenderer::renderPixel(const glm::vec4 &lightPos, const Primitives::Camera &camera, uint32_t x, uint32_t y) const
+{
+    float xOffset = (x + 0.5f) * camera.pixelSize;
+    float yOffset = (y + 0.5f) * camera.pixelSize;
+
+    float worldX = camera.halfWidth - xOffset;
+    float worldY = camera.halfHeight - yOffset;
+
+    glm::vec4 pixel = camera.inverseTransform * glm::vec4(worldX, worldY, -1.0f, 1.0f);
+    glm::vec4 rayO = camera.inverseTransform * glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+    glm::vec4 rayD = glm::normalize(pixel - rayO);
+
+    return renderScene(lightPos, rayO, rayD);
+}
+
+uint32_t CpuRenderer::packUnorm4x8(const glm::vec4 &colour)
+{
+    // Red ends up in the lowest byte, like the GLSL built-in
+    uint32_t packed = 0;
+    for (int channel = 0; channel < 4; channel++)
+    {
+        uint32_t value = static_cast<uint32_t>(std::round(glm::clamp(colour[channel], 0.0f, 1.0f) * 255.0f));
+        packed |= value << (8 * channel);
+    }
+    return packed;
+}
+
+int32_t CpuRenderer::intersect(const glm::vec4 &rayO, const glm::vec4 &rayD, float &resT, glm::vec2 &uv) const
+{
+    int32_t id = -1;
+
+    for (size_t i = 0; i < shapeCount; i++)
+    {
+        float t = shapeIntersect(shapes[i], rayO, rayD);
+        if ((t > EPSILON) && (t < resT))
+        {
+            id = static_cast<int32_t>(i);
+            resT = t;
+        }
+    }
+
+    if (!bvh)
+    {
+        return id;
+    }
+
+    glm::vec4 nRayO = bvh->inverseTransform * rayO;
+    glm::vec4 nRayD = bvh->inverseTransform * rayD;
+    if (nodeWidth == 4)
+    {
+        intersectWide<4>(nRayO, nRayD, uv, resT, id);
+    }
+    else if (nodeWidth == 8)
+    {
+        intersectWide<8>(nRayO, nRayD, uv, resT, id);
+    }
+    else
+    {
+        intersectTLAS(nRayO, nRayD, uv, resT, id);
+    }
+
+    return id;
+}
+
+void CpuRenderer::intersectTLAS(const glm::vec4 &rayO, const glm::vec4 &rayD, glm::vec2 &uv, float &resT, int32_t &id) const
+{
+    if (tlasNodeCount == 0)
+    {
+        return;
+    }
+
+    const Primitives::NodeTLAS *nodes = bvh->TLAS;
+    RayInv rayInv = makeRayInv(rayO, rayD);
+    float rootT = intersectAABB(rayInv, nodes[0]);
+    if (rootT > resT)
+    {
+        return;
+    }
+
+    // Near child first, nodes entered beyond resT are culled and ties go to the lowest triangle index
+    uint32_t stack[Primitives::BVH_MAX_DEPTH + 1];
+    float stackT[Primitives::BVH_MAX_DEPTH + 1];
+    int32_t topStack = 0;
+    stack[0] = 0;
+    stackT[0] = rootT;
+
+    while (topStack > -1)
+    {
+        uint32_t nodeIdx = stack[topStack];
+        float entryT = stackT[topStack];
+        topStack--;
+
+        if (entryT > resT)
+        {
+            continue;
+        }
+
+        const Primitives::NodeTLAS &node = nodes[nodeIdx];
+        uint32_t count = Primitives::nodeCount(node);
+
+        if (count == 0)
+        {
+            uint32_t nearIdx = nodeIdx + 1;
+            uint32_t farIdx = Primitives::nodeOffset(node);
+            float nearT, farT;
+            intersectChildren(rayInv, nodes[nearIdx], nodes[farIdx], nearT, farT);
+
+            if (farT < nearT)
+            {
+                std::swap(nearIdx, farIdx);
+                std::swap(nearT, farT);
+            }
+
+            if (farT <= resT)
+            {
+                topStack++;
+                stack[topStack] = farIdx;
+                stackT[topStack] = farT;
+            }
+            if (nearT <= resT)
+            {
+                topStack++;
+                stack[topStack] = nearIdx;
+                stackT[topStack] = nearT;
+            }
+        }
+        else
+        {
+            intersectLeaf(rayO, rayD, Primitives::nodeOffset(node), count, uv, resT, id);
+        }
+    }
+}
+
+template <uint32_t N>
+void CpuRenderer::intersectWide(const glm::vec4 &rayO, const glm::vec4 &rayD, glm::vec2 &uv, float &resT, int32_t &id) const
+{
+    if (tlasNodeCount == 0)
+    {
+        return;
+    }
+
+    RayInv rayInv = makeRayInv(rayO, rayD);
+    Primitives::NodeWide<N> scratch;
+
+    // The root has no box of its own, its children are tested when it's visited
+    uint32_t stack[Primitives::BVH_WIDE_STACK_SIZE<N>];
+    float stackT[Primitives::BVH_WIDE_STACK_SIZE<N>];
+    int32_t topStack = 0;
+    stack[0] = 0;
+    stackT[0] = -INF;
+
+    while (topStack > -1)
+    {
+        uint32_t nodeIdx = stack[topStack];
+        float entryT = stackT[topStack];
+        topStack--;
+
+        if (entryT > resT)
+        {
+            continue;
+        }
+
+        const Primitives::NodeWide<N> &node = wideNode(nodeIdx, scratch);
+        float t[N];
+        intersectWideNode(rayInv, node, t);
+
+        // Leaves are tested right away, interior children are pushed and sorted so the nearest one is popped next
+        int32_t firstPushed = topStack + 1;
+        for (uint32_t slot = 0; slot < N; slot++)
+        {
+            if (t[slot] > resT)
+            {
+                continue;
+            }
+
+            if (node.count[slot] > 0)
+            {
+                intersectLeaf(rayO, rayD, node.child[slot], node.count[slot], uv, resT, id);
+            }
+            else
+            {
+                topStack++;
+                stack[topStack] = node.child[slot];
+                stackT[topStack] = t[slot];
+            }
+        }
+
+        for (int32_t i = firstPushed + 1; i <= topStack; i++)
+        {
+            uint32_t pushedIdx = stack[i];
+            float pushedT = stackT[i];
+            int32_t j = i - 1;
+            for (; j >= firstPushed && stackT[j] < pushedT; j--)
+            {
+                stack[j + 1] = stack[j];
+                stackT[j + 1] = stackT[j];
+            }
+            stack[j + 1] = pushedIdx;
+            stackT[j + 1] = pushedT;
+        }
+    }
+}
+
+template <uint32_t N>
+const Primitives::NodeWide<N> &CpuRenderer::wideNode(uint32_t nodeIdx, Primitives::NodeWide<N> &scratch) const
+{
+    if (!compressed)
+    {
+        return reinterpret_cast<const Primitives::NodeWide<N> *>(bvh->TLAS)[nodeIdx];
+    }
+
+    scratch = Primitives::dequantizeNode(reinterpret_cast<const Primitives::NodeQuantized<N> *>(bvh->TLAS)[nodeIdx]);
+    return scratch;
+}
+
+// Gathers the corners of up to four triangles, the normals are only needed for the closest hit and left out
+void CpuRenderer::leafTriangles(uint32_t first, uint32_t count, Primitives::NodeBLAS corners[4]) const
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const Primitives::IndexedTriangle &triangle = triangles[first + i];
+        corners[i].point1 = Primitives::poolPosition(positions, triangle.position[0], compressed);
+        corners[i].point2 = Primitives::poolPosition(positions, triangle.position[1], compressed);
+        corners[i].point3 = Primitives::poolPosition(positions, triangle.position[2], compressed);
+    }
+}
+
+void CpuRenderer::intersectLeaf(const glm::vec4 &rayO, const glm::vec4 &rayD, uint32_t first, uint32_t count, glm::vec2 &uv, float &resT, int32_t &id) const
+{
+    for (uint32_t group = 0; group < count; group += 4)
+    {
+        uint32_t groupCount = std::min(count - group, 4u);
+        Primitives::NodeBLAS groupTriangles[4];
+        leafTriangles(first + group, groupCount, groupTriangles);
+
+        float t[4];
+        glm::vec2 primUV[4];
+        intersectTriangles(rayO, rayD, groupTriangles, groupCount, t, primUV);
+
+        for (uint32_t lane = 0; lane < groupCount; lane++)
+        {
+            int32_t primIdx = static_cast<int32_t>(first + group + lane);
+            if ((t[lane] > EPSILON) && (t[lane] < resT || (t[lane] == resT && id < 0 && primIdx < -(id + 1))))
+            {
+                id = -(primIdx + 1);
+                resT = t[lane];
+                uv = primUV[lane];
+            }
+        }
+    }
+}
+
+bool CpuRenderer::occluded(const glm::vec4 &rayO, const glm::vec4 &rayD, float maxT) const
+{
+    for (size_t i = 0; i < shapeCount; i++)
+    {
+        float t = shapeIntersect(shapes[i], rayO, rayD);
+        if ((t > EPSILON) && (t < maxT))
+        {
+            return true;
+        }
+    }
+
+    if (!bvh)
+    {
+        return false;
+    }
+
+    // Object space t matches world space t, the direction isn't renormalised
+    glm::vec4 nRayO = bvh->inverseTransform * rayO;
+    glm::vec4 nRayD = bvh->inverseTransform * rayD;
+    if (nodeWidth == 4)
+    {
+        return occludedWide<4>(nRayO, nRayD, maxT);
+    }
+    if (nodeWidth == 8)
+    {
+        return occludedWide<8>(nRayO, nRayD, maxT);
+    }
+    return occludedTLAS(nRayO, nRayD, maxT);
+}
+
+bool CpuRenderer::occludedTLAS(const glm::vec4 &rayO, const glm::vec4 &rayD, float maxT) const
+{
+    if (tlasNodeCount == 0)
+    {
+        return false;
+    }
+
+    const Primitives::NodeTLAS *nodes = bvh->TLAS;
+    RayInv rayInv = makeRayInv(rayO, rayD);
+
+    // Left-first any-hit traversal, one interior node pushes two children so the stack holds one more than the depth
+    uint32_t stack[Primitives::BVH_MAX_DEPTH + 1];
+    int32_t topStack = 0;
+    stack[0] = 0;
+
+    while (topStack > -1)
+    {
+        const Primitives::NodeTLAS &node = nodes[stack[topStack]];
+        uint32_t nodeIdx = stack[topStack];
+        topStack--;
+
+        if (intersectAABB(rayInv, node) >= maxT)
+        {
+            continue;
+        }
+
+        uint32_t count = Primitives::nodeCount(node);
+        if (count == 0)
+        {
+            stack[++topStack] = Primitives::nodeOffset(node);
+            stack[++topStack] = nodeIdx + 1;
+        }
+        else if (occludedLeaf(rayO, rayD, Primitives::nodeOffset(node), count, maxT))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+template <uint32_t N>
+bool CpuRenderer::occludedWide(const glm::vec4 &rayO, const glm::vec4 &rayD, float maxT) const
+{
+    if (tlasNodeCount == 0)
+    {
+        return false;
+    }
+
+    RayInv rayInv = makeRayInv(rayO, rayD);
+    Primitives::NodeWide<N> scratch;
+
+    uint32_t stack[Primitives::BVH_WIDE_STACK_SIZE<N>];
+    int32_t topStack = 0;
+    stack[0] = 0;
+
+    while (topStack > -1)
+    {
+        const Primitives::NodeWide<N> &node = wideNode(stack[topStack], scratch);
+        topStack--;
+
+        float t[N];
+        intersectWideNode(rayInv, node, t);
+
+        for (uint32_t slot = 0; slot < N; slot++)
+        {
+            if (t[slot] >= maxT)
+            {
+                continue;
+            }
+
+            if (node.count[slot] == 0)
+            {
+                stack[++topStack] = node.child[slot];
+            }
+            else if (occludedLeaf(rayO, rayD, node.child[slot], node.count[slot], maxT))
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+bool CpuRenderer::occludedLeaf(const glm::vec4 &rayO, const glm::vec4 &rayD, uint32_t first, uint32_t count, float maxT) const
+{
+    for (uint32_t group = 0; group < count; group += 4)
+    {
+        uint32_t groupCount = std::min(count - group, 4u);
+        Primitives::NodeBLAS groupTriangles[4];
+        leafTriangles(first + group, groupCount, groupTriangles);
+
+        float t[4];
+        glm::vec2 primUV[4];
+        intersectTriangles(rayO, rayD, groupTriangles, groupCount, t, primUV);
+
+        for (uint32_t lane = 0; lane < groupCount; lane++)
+        {
+            if ((t[lane] > EPSILON) && (t[lane] < maxT))
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+glm::vec4 CpuRenderer::renderScene(const glm::vec4 &lightPos, const glm::vec4 &rayO, const glm::vec4 &rayD) const
+{
+    glm::vec2 uv(0.0f);
+    float t = MAXLEN;
+
+    int32_t objectID = intersect(rayO, rayD, t, uv);
+    if (t >= MAXLEN)
+    {
+        return glm::vec4(0.0f);
+    }
+
+    HitParams hitParams;
+    const Primitives::Material *material;
+    if (objectID >= 0)
+    {
+        const Primitives::Shape &shape = shapes[objectID];
+        hitParams = getHitParams(rayO, rayD, t, shape.inverseTransform, shape.typeEnum, shape.data[3], shape.data[4], shape.data[5], uv);
+        material = &shape.material;
+    }
+    else
+    {
+        Primitives::NodeBLAS triangle = Primitives::poolTriangle(triangles[-(objectID + 1)], positions, normals, compressed);
+        hitParams = getHitParams(rayO, rayD, t, bvh->inverseTransform, 2, triangle.normal1, triangle.normal2, triangle.normal3, uv);
+        material = &bvh->material;
+    }
+
+    glm::vec4 v = lightPos - hitParams.overPoint;
+    bool shadowed = occluded(hitParams.overPoint, glm::normalize(v), glm::length(v));
+
+    return lighting(*material, lightPos, hitParams, shadowed);
+}
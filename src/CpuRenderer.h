@@ -0,0 +1,60 @@
+#pragma once
+
+#define GLM_FORCE_DEFAULT_ALIGNED_GENTYPES
+#include <glm/glm.hpp>
+
+#include "Primitives.h"
+#include "ThreadPool.h"
+
+//  C++ port of raytracer.comp, for machines without a GPU and as a reference to validate the GPU output
+//  against. It reads the same shape, BVH, triangle and vertex pool buffers that are uploaded to the GPU and follows the
+//  shader step by step: ray generation, near-first BVH traversal, shadow rays and Phong lighting. Tiles of
+//  TILE_SIZE x TILE_SIZE pixels are rendered on the thread pool, ray-box and ray-triangle tests use SSE/AVX
+//  when the compiler targets them. Binary, 4-wide and 8-wide BVHs are traversed, as set in the BVH header,
+//  compressed BVHs are decoded node by node and triangle by triangle as they are visited.
+class CpuRenderer
+{
+public:
+    static const uint32_t TILE_SIZE = 32; // WORKGROUP_SIZE in raytracer.comp
+
+    explicit CpuRenderer(ThreadPool &pool = ThreadPool::global());
+
+    //  The buffers aren't copied and must outlive the renderer
+    void setScene(const Primitives::Shape *shapes, size_t shapeCount, const Primitives::BVHBuffers &buffers);
+
+    //  Writes camera.width * camera.height pixels in the layout of the output buffer, packed like packUnorm4x8
+    //  when packed is set and as RGBA32F otherwise, tonemap matches the shader's TONEMAP constant
+    void render(const glm::vec4 &lightPos, const Primitives::Camera &camera, void *output, bool packed, bool tonemap) const;
+
+    glm::vec4 renderPixel(const glm::vec4 &lightPos, const Primitives::Camera &camera, uint32_t x, uint32_t y) const;
+
+    static uint32_t packUnorm4x8(const glm::vec4 &colour);
+
+private:
+    ThreadPool &pool;
+
+    const Primitives::Shape *shapes = nullptr;
+    size_t shapeCount = 0;
+    const Primitives::BVH *bvh = nullptr;
+    uint32_t nodeWidth = 2;
+    size_t tlasNodeCount = 0;
+    bool compressed = false;
+    const Primitives::IndexedTriangle *triangles = nullptr;
+    const void *positions = nullptr;
+    const void *normals = nullptr;
+
+    int32_t intersect(const glm::vec4 &rayO, const glm::vec4 &rayD, float &resT, glm::vec2 &uv) const;
+    void intersectTLAS(const glm::vec4 &rayO, const glm::vec4 &rayD, glm::vec2 &uv, float &resT, int32_t &id) const;
+    bool occluded(const glm::vec4 &rayO, const glm::vec4 &rayD, float maxT) const;
+    bool occludedTLAS(const glm::vec4 &rayO, const glm::vec4 &rayD, float maxT) const;
+    template <uint32_t N>
+    void intersectWide(const glm::vec4 &rayO, const glm::vec4 &rayD, glm::vec2 &uv, float &resT, int32_t &id) const;
+    template <uint32_t N>
+    bool occludedWide(const glm::vec4 &rayO, const glm::vec4 &rayD, float maxT) const;
+    template <uint32_t N>
+    const Primitives::NodeWide<N> &wideNode(uint32_t nodeIdx, Primitives::NodeWide<N> &scratch) const;
+    void leafTriangles(uint32_t first, uint32_t count, Primitives::NodeBLAS corners[4]) const;
+    void intersectLeaf(const glm::vec4 &rayO, const glm::vec4 &rayD, uint32_t first, uint32_t count, glm::vec2 &uv, float &resT, int32_t &id) const;
+    bool occludedLeaf(const glm::vec4 &rayO, const glm::vec4 &rayD, uint32_t first, uint32_t count, float maxT) const;
+    glm::vec4 renderScene(const glm::vec4 &lightPos, const glm::vec4 &rayO, const glm::vec4 &rayD) const;
+};
@@ -84,4 +84,49 @@ void ImageWriter::writeToPPM(const std::string &fileName, std::vector<unsigned c
     }
     out << "\n";
     out.close();
-}
\ No newline at end of file
+}
+
+void ImageWriter::writeToBinaryPPM(const std::string &fileName, const unsigned char *rgba, uint32_t width, uint32_t height)
+{
+    std::ofstream out(fileName, std::ios::binary);
+
+    if (out.fail())
+    {
+        throw std::runtime_error("Failed to open file.");
+    }
+
+    std::vector<unsigned char> rgb(size_t(width) * height * 3);
+    for (size_t i = 0, j = 0; i < rgb.size(); i += 3, j += 4)
+    {
+        rgb[i] = rgba[j];
+        rgb[i + 1] = rgba[j + 1];
+        rgb[i + 2] = rgba[j + 2];
+    }
+
+    out << "P6\n"
+        << width << " " << height << "\n255\n";
+    out.write(reinterpret_cast<const char *>(rgb.data()), rgb.size());
+
+    if (out.fail())
+    {
+        throw std::runtime_error("Failed to write file.");
+    }
+}
+
+void ImageWriter::writeToPAM(const std::string &fileName, const unsigned char *rgba, uint32_t width, uint32_t height)
+{
+    std::ofstream out(fileName, std::ios::binary);
+
+    if (out.fail())
+    {
+        throw std::runtime_error("Failed to open file.");
+    }
+
+    out << "P7\nWIDTH " << width << "\nHEIGHT " << height << "\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n";
+    out.write(reinterpret_cast<const char *>(rgba), size_t(width) * height * 4);
+
+    if (out.fail())
+    {
+        throw std::runtime_error("Failed to write file.");
+    }
+}
@@ -12,4 +12,9 @@ namespace ImageWriter
                          std::ofstream *streamPtr);
 
     void writeToPPM(const std::string &fileName, std::vector<unsigned char> &image, uint32_t width, uint32_t height);
+
+    // Binary writers taking width * height RGBA8 pixels, written with a single bulk write after the header.
+    // P6 drops the alpha channel, PAM keeps it so rgba can be written as is, e.g. straight from mapped memory.
+    void writeToBinaryPPM(const std::string &fileName, const unsigned char *rgba, uint32_t width, uint32_t height);
+    void writeToPAM(const std::string &fileName, const unsigned char *rgba, uint32_t width, uint32_t height);
 }; // namespace ImageWriter
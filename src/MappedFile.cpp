@@ -0,0 +1,186 @@
+#include "MappedFile.h"
+
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+{
+    *this = std::move(other);
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) noexcept
+{
+    if (this != &other)
+    {
+        close();
+
+        std::swap(mapped, other.mapped);
+        std::swap(mappedSize, other.mappedSize);
+        std::swap(opened, other.opened);
+#ifdef _WIN32
+        std::swap(fileHandle, other.fileHandle);
+        std::swap(mappingHandle, other.mappingHandle);
+#endif
+    }
+
+    return *this;
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const std::string &path, bool copyOnWrite)
+{
+    close();
+
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize))
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    fileHandle = file;
+    mappedSize = static_cast<size_t>(fileSize.QuadPart);
+    opened = true;
+
+    // Empty files can't be mapped, they simply have no data
+    if (mappedSize == 0)
+    {
+        return true;
+    }
+
+    mappingHandle = CreateFileMappingA(file, nullptr, copyOnWrite ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr);
+    if (mappingHandle == nullptr)
+    {
+        close();
+        return false;
+    }
+
+    mapped = static_cast<char *>(MapViewOfFile(mappingHandle, copyOnWrite ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0));
+    if (mapped == nullptr)
+    {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (mapped)
+    {
+        UnmapViewOfFile(mapped);
+    }
+    if (mappingHandle)
+    {
+        CloseHandle(mappingHandle);
+    }
+    if (fileHandle)
+    {
+        CloseHandle(fileHandle);
+    }
+
+    mapped = nullptr;
+    mappingHandle = nullptr;
+    fileHandle = nullptr;
+    mappedSize = 0;
+    opened = false;
+}
+
+#else
+
+bool MappedFile::open(const std::string &path, bool copyOnWrite)
+{
+    close();
+
+    int file = ::open(path.c_str(), O_RDONLY);
+    if (file < 0)
+    {
+        return false;
+    }
+
+    struct stat fileStat;
+    if (fstat(file, &fileStat) != 0)
+    {
+        ::close(file);
+        return false;
+    }
+
+    mappedSize = static_cast<size_t>(fileStat.st_size);
+    opened = true;
+
+    // Empty files can't be mapped, they simply have no data
+    if (mappedSize > 0)
+    {
+        void *address = mmap(nullptr, mappedSize, copyOnWrite ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, file, 0);
+        if (address == MAP_FAILED)
+        {
+            ::close(file);
+            mappedSize = 0;
+            opened = false;
+            return false;
+        }
+
+        mapped = static_cast<char *>(address);
+        madvise(mapped, mappedSize, MADV_SEQUENTIAL);
+    }
+
+    // The mapping keeps its own reference to the file
+    ::close(file);
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (mapped)
+    {
+        munmap(mapped, mappedSize);
+    }
+
+    mapped = nullptr;
+    mappedSize = 0;
+    opened = false;
+}
+
+#endif
+
+bool MappedFile::isOpen() const
+{
+    return opened;
+}
+
+char *MappedFile::data() const
+{
+    return mapped;
+}
+
+size_t MappedFile::size() const
+{
+    return mappedSize;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+//  Read-only memory mapping of a whole file. With copyOnWrite the pages can be written to, the changes
+//  stay private to the process and never reach the file.
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    MappedFile(MappedFile &&other) noexcept;
+    MappedFile &operator=(MappedFile &&other) noexcept;
+
+    bool open(const std::string &path, bool copyOnWrite = false);
+    void close();
+
+    bool isOpen() const;
+    char *data() const;
+    size_t size() const;
+
+private:
+    char *mapped = nullptr;
+    size_t mappedSize = 0;
+    bool opened = false;
+
+#ifdef _WIN32
+    void *fileHandle = nullptr;
+    void *mappingHandle = nullptr;
+#endif
+};
@@ -5,6 +5,7 @@
 #include <glm/gtc/matrix_inverse.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include <iostream>
 #include <fstream>
 #include <sstream>
 #include <string>
@@ -13,6 +14,22 @@
 #include <limits>
 #include <iterator>
 #include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <random>
+#include <stdexcept>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "MappedFile.h"
+#include "ThreadPool.h"
 
 namespace Primitives
 {
@@ -39,12 +56,73 @@ namespace Primitives
         uint32_t typeEnum;
     };
 
+    //  TLAS nodes are stored depth-first, so the left child of an interior node directly follows it.
+    //  The w components hold uint32 bits: first.w is the right child index of an interior node or the
+    //  first triangle of a leaf, second.w is the number of triangles in a leaf and zero otherwise.
     struct NodeTLAS
     {
         glm::vec4 first;
         glm::vec4 second;
     };
 
+    //  TLAS node of a 4- or 8-wide BVH, made by collapseBVH from the binary tree. The boxes of all children are
+    //  stored per axis so one SIMD register, or one vec4 load in the shader, covers four children. Unused slots
+    //  have an empty box at +infinity that every ray misses, their child and count are 0.
+    template <uint32_t N>
+    struct alignas(16) NodeWide
+    {
+        float minX[N];
+        float minY[N];
+        float minZ[N];
+        float maxX[N];
+        float maxY[N];
+        float maxZ[N];
+        uint32_t child[N]; // index of the wide node of an interior child, first triangle of a leaf
+        uint32_t count[N]; // number of triangles of a leaf, 0 for interior children
+    };
+
+    //  TLAS node of a compressed wide BVH, made by quantizeBVH. The child boxes take 8 bits per bound, relative to the
+    //  box of the node: a child spans origin + qMin * 2^exponent to origin + qMax * 2^exponent on each axis, rounded
+    //  outwards so it contains the exact box. Unused slots have qMinX > qMaxX.
+    template <uint32_t N>
+    struct alignas(16) NodeQuantized
+    {
+        float origin[3];
+        int8_t exponent[3];
+        uint8_t padding;
+        uint8_t qMinX[N];
+        uint8_t qMinY[N];
+        uint8_t qMinZ[N];
+        uint8_t qMaxX[N];
+        uint8_t qMaxY[N];
+        uint8_t qMaxZ[N];
+        uint16_t count[N]; // as in NodeWide
+        uint32_t child[N];
+    };
+
+    //  Triangle of an IndexedMesh, indices of its corners in the position and normal pools
+    struct IndexedTriangle
+    {
+        uint32_t position[3];
+        uint32_t normal[3];
+    };
+
+    //  Position in the pool of a compressed BVH, without the w component
+    struct PackedPosition
+    {
+        float position[3];
+    };
+
+    //  Triangles with their positions and normals pooled as in the OBJ file, a corner shared by several triangles is
+    //  stored once. Positions have w = 1 and normals w = 0.
+    struct IndexedMesh
+    {
+        std::vector<glm::vec4> positions;
+        std::vector<glm::vec4> normals;
+        std::vector<IndexedTriangle> triangles;
+    };
+
+    //  Triangle with its own copy of the corners, as stored in a Mesh and passed to the ray-triangle tests
     struct NodeBLAS
     {
         glm::vec4 point1;
@@ -68,10 +146,97 @@ namespace Primitives
     {
         glm::mat4 inverseTransform;
         alignas(16) Material material;
-        NodeTLAS TLAS[1]; // bounding parameters
+        uint32_t nodeWidth;  // children per TLAS node, 2 for NodeTLAS, 4 or 8 for NodeWide
+        uint32_t compressed; // 1 for NodeQuantized TLAS nodes, PackedPosition positions and encodeNormal normals
+        NodeTLAS TLAS[1];    // bounding parameters, NodeWide<nodeWidth> or NodeQuantized<nodeWidth> in place of NodeTLAS for wide BVHs
         //    NodeBLAS BLAS[1]; // shape primitives
     };
 
+    enum class BVHBuildMode
+    {
+        Median, // split at the median centroid along the longest axis
+        SAH,    // binned surface area heuristic
+        LBVH    // linear BVH over sorted Morton codes, fastest to build
+    };
+
+    const uint32_t BVH_MAX_DEPTH = 64; // matches MAX_STACK_SIZE in raytracer.comp
+
+    //  The wide tree is no deeper than the binary one, and every node visited on the way down can leave N - 1 of its
+    //  children on the traversal stack, so an N-wide traversal needs BVH_MAX_DEPTH * (N - 1) + 1 entries
+    template <uint32_t N>
+    constexpr uint32_t BVH_WIDE_STACK_SIZE = BVH_MAX_DEPTH * (N - 1) + 1; // matches WIDE_STACK_SIZE in raytracer.comp
+
+    struct BVHSettings
+    {
+        BVHBuildMode mode = BVHBuildMode::Median;
+        uint32_t binCount = 16;
+        float traversalCost = 1.f;
+        float intersectionCost = 1.f;
+        uint32_t maxLeafSize = 2;
+        uint32_t parallelThreshold = 16384; // subtrees with more triangles are built as parallel tasks, 0 builds serially
+        uint32_t mortonBits = 30;           // LBVH Morton code length, 30 or 63
+        uint32_t width = 2;                 // children per TLAS node, 4 or 8 collapse the binary tree into NodeWide
+        bool compress = false;              // quantized TLAS nodes, packed positions and octahedral normals, needs width 4 or 8
+    };
+
+    struct BVHStats
+    {
+        float sahCost = 0.f; // normalised to the surface area of the root
+        uint32_t interiorNodes = 0;
+        uint32_t leafNodes = 0;
+        uint32_t maxDepth = 0;
+        uint32_t wideNodes = 0; // nodes and depth after collapseBVH, 0 for binary BVHs
+        uint32_t wideDepth = 0;
+    };
+
+    //  BVH header with the TLAS, the triangles and their position and normal pools, ready to be uploaded. They point
+    //  into the mapped cache file when the BVH was loaded from one, otherwise into the storage. Leaves cover ranges
+    //  of triangles, which index the pools.
+    struct BVHBuffers
+    {
+        BVH *bvh = nullptr;
+        size_t bvhSize = 0;
+        IndexedTriangle *triangles = nullptr;
+        size_t trianglesSize = 0;
+        void *positions = nullptr; // glm::vec4, PackedPosition for compressed BVHs
+        size_t positionsSize = 0;
+        void *normals = nullptr; // glm::vec4, uint32_t from encodeNormal for compressed BVHs
+        size_t normalsSize = 0;
+        size_t triangleCount = 0;
+
+        MappedFile cacheFile;
+        std::vector<char> bvhStorage;
+        IndexedMesh meshStorage;
+        std::vector<PackedPosition> packedPositionStorage;
+        std::vector<uint32_t> packedNormalStorage;
+    };
+
+    const char BVH_CACHE_MAGIC[8] = {'H', 'V', 'B', 'V', 'H', 'C', 'A', 'C'};
+    const uint32_t BVH_CACHE_VERSION = 4;
+
+    //  Start of a BVH cache file. The BVH header and TLAS follow at bvhOffset, then the triangles, positions and normals
+    //  at their offsets, all in the layout of the GPU buffers. The struct sizes catch layout changes that forgot to
+    //  bump the version.
+    struct BVHCacheHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t bvhStructSize;
+        uint32_t tlasNodeSize;
+        uint32_t triangleStructSize;
+        uint64_t sourceHash;
+        uint64_t settingsHash;
+        uint64_t bvhOffset;
+        uint64_t bvhSize;
+        uint64_t trianglesOffset;
+        uint64_t trianglesSize;
+        uint64_t positionsOffset;
+        uint64_t positionsSize;
+        uint64_t normalsOffset;
+        uint64_t normalsSize;
+        BVHStats stats;
+    };
+
     struct Camera
     {
         glm::mat4 inverseTransform;
@@ -82,7 +247,7 @@ namespace Primitives
         uint32_t height;
     };
 
-    Camera makeCamera(glm::vec4 position, glm::vec4 centre, glm::vec4 up, uint32_t hsize,
+    inline Camera makeCamera(glm::vec4 position, glm::vec4 centre, glm::vec4 up, uint32_t hsize,
                       uint32_t vsize, float fov)
     {
         Camera camera{};
@@ -114,7 +279,7 @@ namespace Primitives
     //static int sNextId = 0;
     //uint32_t getNextId() { return ++sNextId; }
 
-    Shape makeSphere(Material &material, glm::mat4 &transform)
+    inline Shape makeSphere(Material &material, glm::mat4 &transform)
     {
         Shape shape{};
         shape.typeEnum = 0;
@@ -124,7 +289,7 @@ namespace Primitives
         return shape;
     }
 
-    Shape makePlane(Material &material, glm::mat4 &transform)
+    inline Shape makePlane(Material &material, glm::mat4 &transform)
     {
         Shape shape{};
         shape.typeEnum = 1;
@@ -134,7 +299,7 @@ namespace Primitives
         return shape;
     }
 
-    Shape makeTriangle(std::vector<glm::vec4> &params, Material &material, glm::mat4 &transform)
+    inline Shape makeTriangle(std::vector<glm::vec4> &params, Material &material, glm::mat4 &transform)
     {
         Shape shape{};
         shape.typeEnum = 2;
@@ -149,169 +314,347 @@ namespace Primitives
         return shape;
     }
 
-    std::vector<NodeBLAS> parseObjFile(std::string const &path)
+    //  Face index of an OBJ chunk, zero based. An absolute index refers to the whole file, a relative (negative) one
+    //  is an offset from the first element of the chunk, below zero when it reaches back into earlier chunks, and is
+    //  resolved when the chunks are stitched together.
+    struct ObjIndex
+    {
+        int32_t value;
+        bool relative;
+    };
+
+    //  Geometry parsed from one newline-aligned chunk of an OBJ file
+    struct ObjChunk
     {
-        std::string line;
+        std::vector<glm::vec4> vertices;
+        std::vector<glm::vec4> normals;
+        std::vector<ObjIndex> vertexIndices;
+        std::vector<ObjIndex> normalIndices;
+    };
+
+    //  Normal index of a face corner without a normal
+    const ObjIndex OBJ_NO_INDEX{std::numeric_limits<int32_t>::max(), false};
 
-        std::ifstream in(path, std::ios::in);
+    inline const char *skipBlanks(const char *first, const char *last)
+    {
+        while (first < last && (*first == ' ' || *first == '\t' || *first == '\r'))
+            ++first;
+        return first;
+    }
 
-        if (!in)
+    inline const char *parseFloat(const char *first, const char *last, float &value)
+    {
+        first = skipBlanks(first, last);
+        if (first < last && *first == '+')
+            ++first;
+
+#if defined(__cpp_lib_to_chars)
+        auto result = std::from_chars(first, last, value);
+        return result.ec == std::errc() ? result.ptr : nullptr;
+#else
+        //  Floating point from_chars isn't available everywhere yet, strtof needs a terminated copy of the token
+        char token[64];
+        size_t length = 0;
+        while (first + length < last && length < sizeof(token) - 1 && first[length] != ' ' && first[length] != '\t' && first[length] != '\r' && first[length] != '\n')
         {
-            std::cout << "Impossible to open the file: " << path << std::endl;
+            token[length] = first[length];
+            ++length;
         }
+        token[length] = '\0';
+
+        char *end;
+        value = std::strtof(token, &end);
+        return end == token ? nullptr : first + (end - token);
+#endif
+    }
+
+    inline const char *parseIndex(const char *first, const char *last, int32_t &value)
+    {
+        if (first < last && *first == '+')
+            ++first;
+
+        auto result = std::from_chars(first, last, value);
+        return result.ec == std::errc() ? result.ptr : nullptr;
+    }
 
-        std::vector<unsigned int> vertexIndices;
-        //    std::vector<unsigned int> uvIndices;
-        std::vector<unsigned int> normalIndices;
-        std::vector<glm::vec4> temp_vertices;
-        // std::vector<glm::dvec2> temp_uvs;
-        std::vector<glm::vec4> temp_normals;
+    //  Converts a one based (or negative, relative) OBJ index to the zero based form described at ObjIndex
+    inline ObjIndex chunkIndex(int32_t index, size_t chunkCount)
+    {
+        if (index == 0)
+            throw std::runtime_error("invalid face index 0 in OBJ file");
+
+        return index > 0 ? ObjIndex{index - 1, false} : ObjIndex{static_cast<int32_t>(chunkCount) + index, true};
+    }
+
+    //  Index of the whole file, base is the number of elements in the chunks before this one
+    inline uint32_t resolveObjIndex(const ObjIndex &index, size_t base, size_t count)
+    {
+        int64_t resolved = index.relative ? static_cast<int64_t>(base) + index.value : index.value;
+        if (resolved < 0 || static_cast<size_t>(resolved) >= count)
+            throw std::runtime_error("invalid face index in OBJ file");
+
+        return static_cast<uint32_t>(resolved);
+    }
+
+    inline void parseObjChunk(const char *first, const char *last, ObjChunk &chunk)
+    {
+        std::vector<ObjIndex> faceVertices;
+        std::vector<ObjIndex> faceNormals;
 
-        while (std::getline(in, line))
+        while (first < last)
         {
-            if (line.substr(0, 2) == "v ")
-            {
-                std::istringstream v(line.substr(2));
-                glm::vec4 vertex;
+            const char *lineEnd = static_cast<const char *>(memchr(first, '\n', last - first));
+            if (lineEnd == nullptr)
+                lineEnd = last;
 
-                double x, y, z;
-                v >> x;
-                v >> y;
-                v >> z;
+            const char *p = skipBlanks(first, lineEnd);
+            first = lineEnd + 1;
 
-                vertex = glm::vec4(x, y, z, 1.f);
-                temp_vertices.push_back(vertex);
-            }
-            else if (line.substr(0, 2) == "vn")
+            if (lineEnd - p < 2)
+                continue;
+
+            if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
             {
-                std::istringstream vn(line.substr(3));
-                glm::vec4 normal;
+                glm::vec4 vertex(0.f, 0.f, 0.f, 1.f);
+                p += 2;
+                for (int i = 0; i < 3 && p != nullptr; i++)
+                    p = parseFloat(p, lineEnd, vertex[i]);
 
-                double x, y, z;
-                vn >> x;
-                vn >> y;
-                vn >> z;
+                chunk.vertices.push_back(vertex);
+            }
+            else if (p[0] == 'v' && p[1] == 'n')
+            {
+                glm::vec4 normal(0.f);
+                p += 2;
+                for (int i = 0; i < 3 && p != nullptr; i++)
+                    p = parseFloat(p, lineEnd, normal[i]);
 
-                normal = glm::vec4(x, y, z, 0.f);
-                temp_normals.push_back(normal);
+                chunk.normals.push_back(normal);
             }
-            else if (line.substr(0, 2) == "f ")
+            else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
             {
-                unsigned int vertexIndex[3], uvIndex[3], normalIndex[3];
-                std::istringstream f(line.substr(2));
+                faceVertices.clear();
+                faceNormals.clear();
+                p += 2;
 
-                if (line.find('/') != std::string::npos)
+                //  Corners are v, v/vt, v//vn or v/vt/vn
+                while ((p = skipBlanks(p, lineEnd)) < lineEnd)
                 {
-                    for (int i = 0; i < 3; i++)
+                    int32_t vertexIndex = 0;
+                    ObjIndex normalIndex = OBJ_NO_INDEX;
+
+                    p = parseIndex(p, lineEnd, vertexIndex);
+                    if (p == nullptr)
+                        break;
+
+                    if (p < lineEnd && *p == '/')
                     {
-                        std::string vStr, vtStr, vnStr;
-                        std::getline(f, vStr, '/');
-                        std::getline(f, vtStr, '/');
-                        std::getline(f, vnStr, ' ');
-
-                        vertexIndex[i] = atoi(vStr.c_str());
-                        // uvIndex[i] = atoi(vtStr.c_str());
-                        normalIndex[i] = atoi(vnStr.c_str());
+                        ++p;
+                        int32_t uvIndex;
+                        if (p < lineEnd && *p != '/')
+                            p = parseIndex(p, lineEnd, uvIndex);
+
+                        if (p != nullptr && p < lineEnd && *p == '/')
+                        {
+                            int32_t fileNormalIndex;
+                            p = parseIndex(p + 1, lineEnd, fileNormalIndex);
+                            if (p == nullptr)
+                                break;
+                            normalIndex = chunkIndex(fileNormalIndex, chunk.normals.size());
+                        }
+                        if (p == nullptr)
+                            break;
                     }
+
+                    faceVertices.push_back(chunkIndex(vertexIndex, chunk.vertices.size()));
+                    faceNormals.push_back(normalIndex);
+
+                    while (p < lineEnd && *p != ' ' && *p != '\t')
+                        ++p;
                 }
-                else
+
+                //  Polygons are split into a fan of triangles
+                for (size_t i = 2; i < faceVertices.size(); i++)
                 {
-                    std::string vStr[3];
-                    std::getline(f, vStr[0], ' ');
-                    std::getline(f, vStr[1], ' ');
-                    std::getline(f, vStr[2], ' ');
-                    vertexIndex[0] = atoi(vStr[0].c_str());
-                    vertexIndex[1] = atoi(vStr[1].c_str());
-                    vertexIndex[2] = atoi(vStr[2].c_str());
+                    chunk.vertexIndices.insert(chunk.vertexIndices.end(), {faceVertices[0], faceVertices[i - 1], faceVertices[i]});
+                    chunk.normalIndices.insert(chunk.normalIndices.end(), {faceNormals[0], faceNormals[i - 1], faceNormals[i]});
                 }
-
-                vertexIndices.push_back(vertexIndex[0]);
-                vertexIndices.push_back(vertexIndex[1]);
-                vertexIndices.push_back(vertexIndex[2]);
-                // uvIndices.push_back(uvIndex[0]);
-                // uvIndices.push_back(uvIndex[1]);
-                // uvIndices.push_back(uvIndex[2]);
-                normalIndices.push_back(normalIndex[0]);
-                normalIndices.push_back(normalIndex[1]);
-                normalIndices.push_back(normalIndex[2]);
-            }
-            else if (line.substr(0, 2) == "vt")
-            {
-                // std::istringstream vt(line.substr(3));
-                // glm::dvec2 uv;
-                // int U, V;
-                // vt >> U;
-                // vt >> V;
-                // uv = glm::dvec2(U, V);
-                // temp_uvs.push_back(uv);
             }
         }
+    }
+
+    //  Parses the OBJ file from a memory mapping, in newline-aligned chunks on the thread pool. The per-chunk
+    //  vertex, normal and face arrays are stitched together in file order, so the result matches a serial parse.
+    //  The vertices and normals of the file become the pools of the mesh, faces without normals get a flat one
+    //  appended to the normal pool.
+    inline IndexedMesh parseObjFile(std::string const &path)
+    {
+        MappedFile file;
+
+        if (!file.open(path))
+        {
+            std::cout << "Impossible to open the file: " << path << std::endl;
+            return {};
+        }
+
+        const char *data = file.data();
+        size_t size = file.size();
 
-        std::vector<NodeBLAS> triangleParams;
-        triangleParams.reserve((vertexIndices.size() / 3));
+        ThreadPool &pool = ThreadPool::global();
+        const size_t minChunkSize = 1 << 20;
+        size_t chunkSize = std::max(minChunkSize, size / (4 * pool.getThreadCount()) + 1);
 
-        for (unsigned int i = 0; i < vertexIndices.size(); i += 3)
+        std::vector<const char *> chunkStarts = {data};
+        while (chunkStarts.back() + chunkSize < data + size)
         {
-            NodeBLAS nextNode = {};
+            const char *newline = static_cast<const char *>(memchr(chunkStarts.back() + chunkSize, '\n', data + size - (chunkStarts.back() + chunkSize)));
+            if (newline == nullptr)
+                break;
+            chunkStarts.push_back(newline + 1);
+        }
+        chunkStarts.push_back(data + size);
+
+        uint32_t chunkCount = chunkStarts.size() - 1;
+        std::vector<ObjChunk> chunks(chunkCount);
+        pool.parallelFor(0, chunkCount, 1, [&](uint32_t chunkBegin, uint32_t chunkEnd) {
+            for (uint32_t i = chunkBegin; i < chunkEnd; i++)
+                parseObjChunk(chunkStarts[i], chunkStarts[i + 1], chunks[i]);
+        });
+
+        //  Flat normals are appended after the ones of the file, in face order
+        std::vector<size_t> vertexBase(chunkCount + 1, 0), normalBase(chunkCount + 1, 0), triangleBase(chunkCount + 1, 0), flatBase(chunkCount + 1, 0);
+        bool fileHasNormals = false;
+        for (uint32_t i = 0; i < chunkCount; i++)
+            fileHasNormals = fileHasNormals || !chunks[i].normals.empty();
+
+        auto isFlat = [fileHasNormals](const ObjChunk &chunk, size_t i) {
+            auto missing = [](const ObjIndex &index) { return !index.relative && index.value == OBJ_NO_INDEX.value; };
+            return !fileHasNormals || missing(chunk.normalIndices[i]) || missing(chunk.normalIndices[i + 1]) || missing(chunk.normalIndices[i + 2]);
+        };
 
-            if (temp_normals.empty())
+        std::vector<size_t> flatCounts(chunkCount, 0);
+        pool.parallelFor(0, chunkCount, 1, [&](uint32_t chunkBegin, uint32_t chunkEnd) {
+            for (uint32_t c = chunkBegin; c < chunkEnd; c++)
             {
-                glm::vec3 e1 = temp_vertices[vertexIndices[i + 1] - 1] - temp_vertices[vertexIndices[i] - 1];
-                glm::vec3 e2 = temp_vertices[vertexIndices[i + 2] - 1] - temp_vertices[vertexIndices[i] - 1];
-                glm::vec4 normal = glm::vec4(glm::normalize(glm::cross(e2, e1)), 0.0);
+                for (size_t i = 0; i < chunks[c].vertexIndices.size(); i += 3)
+                    flatCounts[c] += isFlat(chunks[c], i) ? 1 : 0;
+            }
+        });
+
+        for (uint32_t i = 0; i < chunkCount; i++)
+        {
+            vertexBase[i + 1] = vertexBase[i] + chunks[i].vertices.size();
+            normalBase[i + 1] = normalBase[i] + chunks[i].normals.size();
+            triangleBase[i + 1] = triangleBase[i] + chunks[i].vertexIndices.size() / 3;
+            flatBase[i + 1] = flatBase[i] + flatCounts[i];
+        }
 
-                nextNode = NodeBLAS{
-                    temp_vertices[vertexIndices[i] - 1],
-                    temp_vertices[vertexIndices[i + 1] - 1],
-                    temp_vertices[vertexIndices[i + 2] - 1],
-                    normal,
-                    normal,
-                    normal};
+        IndexedMesh mesh;
+        mesh.positions.resize(vertexBase.back());
+        mesh.normals.resize(normalBase.back() + flatBase.back());
+        mesh.triangles.resize(triangleBase.back());
+
+        pool.parallelFor(0, chunkCount, 1, [&](uint32_t chunkBegin, uint32_t chunkEnd) {
+            for (uint32_t i = chunkBegin; i < chunkEnd; i++)
+            {
+                std::copy(chunks[i].vertices.begin(), chunks[i].vertices.end(), mesh.positions.begin() + vertexBase[i]);
+                std::copy(chunks[i].normals.begin(), chunks[i].normals.end(), mesh.normals.begin() + normalBase[i]);
             }
-            else
+        });
+
+        size_t fileNormalCount = normalBase.back();
+        pool.parallelFor(0, chunkCount, 1, [&](uint32_t chunkBegin, uint32_t chunkEnd) {
+            for (uint32_t c = chunkBegin; c < chunkEnd; c++)
             {
-                nextNode = NodeBLAS{
-                    temp_vertices[vertexIndices[i] - 1],
-                    temp_vertices[vertexIndices[i + 1] - 1],
-                    temp_vertices[vertexIndices[i + 2] - 1],
-                    temp_normals[normalIndices[i] - 1],
-                    temp_normals[normalIndices[i + 1] - 1],
-                    temp_normals[normalIndices[i + 2] - 1]
+                const ObjChunk &chunk = chunks[c];
+                size_t flatNormal = fileNormalCount + flatBase[c];
 
-                };
+                for (size_t i = 0; i < chunk.vertexIndices.size(); i += 3)
+                {
+                    IndexedTriangle &triangle = mesh.triangles[triangleBase[c] + i / 3];
+                    for (int j = 0; j < 3; j++)
+                        triangle.position[j] = resolveObjIndex(chunk.vertexIndices[i + j], vertexBase[c], mesh.positions.size());
+
+                    if (isFlat(chunk, i))
+                    {
+                        glm::vec3 e1 = mesh.positions[triangle.position[1]] - mesh.positions[triangle.position[0]];
+                        glm::vec3 e2 = mesh.positions[triangle.position[2]] - mesh.positions[triangle.position[0]];
+                        mesh.normals[flatNormal] = glm::vec4(glm::normalize(glm::cross(e2, e1)), 0.0);
+
+                        for (int j = 0; j < 3; j++)
+                            triangle.normal[j] = static_cast<uint32_t>(flatNormal);
+                        flatNormal++;
+                    }
+                    else
+                    {
+                        for (int j = 0; j < 3; j++)
+                            triangle.normal[j] = resolveObjIndex(chunk.normalIndices[i + j], normalBase[c], fileNormalCount);
+                    }
+                }
             }
+        });
 
-            triangleParams.push_back(nextNode);
-            //        triangleParams.push_back(temp_vertices[vertexIndices[i] - 1]);
-            //        triangleParams.push_back(temp_vertices[vertexIndices[i + 1] - 1]);
-            //        triangleParams.push_back(temp_vertices[vertexIndices[i + 2] - 1]);
-            //        triangleParams.push_back(temp_normals[normalIndices[i] - 1]);
-            //        triangleParams.push_back(temp_normals[normalIndices[i + 1] - 1]);
-            //        triangleParams.push_back(temp_normals[normalIndices[i + 2] - 1]);
-        }
+        return mesh;
+    }
 
-        return triangleParams;
+    inline NodeBLAS meshTriangle(const IndexedMesh &mesh, size_t index)
+    {
+        const IndexedTriangle &triangle = mesh.triangles[index];
+        return NodeBLAS{mesh.positions[triangle.position[0]], mesh.positions[triangle.position[1]], mesh.positions[triangle.position[2]],
+                        mesh.normals[triangle.normal[0]], mesh.normals[triangle.normal[1]], mesh.normals[triangle.normal[2]]};
     }
 
-    Mesh *makeMesh(std::string const &path, Material &material, glm::mat4 &transform, size_t &size)
+    inline Mesh *makeMesh(std::string const &path, Material &material, glm::mat4 &transform, size_t &size)
     {
-        std::vector<NodeBLAS> triangleParams = parseObjFile(path);
+        IndexedMesh indexedMesh = parseObjFile(path);
 
-        size_t sizeParams = triangleParams.size() * sizeof(NodeBLAS);
+        size_t sizeParams = indexedMesh.triangles.size() * sizeof(NodeBLAS);
         size = sizeof(Mesh) + sizeParams;
 
         char *ptr = new char[sizeof(Mesh) - 1 + sizeParams];
         Mesh *mesh = reinterpret_cast<Mesh *>(ptr);
         mesh->inverseTransform = glm::affineInverse(transform);
         mesh->material = material;
-        memcpy(mesh->nodes, triangleParams.data(), sizeParams);
+        for (size_t i = 0; i < indexedMesh.triangles.size(); i++)
+            mesh->nodes[i] = meshTriangle(indexedMesh, i);
 
         //    size += sizeof(Mesh);
 
         return mesh;
     }
 
-    NodeTLAS mergeBounds(const NodeTLAS &b1, const NodeTLAS &b2)
+    //  Soup of small randomly oriented triangles filling the cube [-1, 1]^3, the micro-benchmark scene for traversal.
+    //  Uses the raw mt19937 output, which the standard fixes, so every platform gets the same scene for a seed.
+    //  The triangles share nothing, each has its own three positions and flat normal.
+    inline IndexedMesh makeBenchmarkTriangles(uint32_t count, float triangleSize = 0.05f, uint32_t seed = 1)
+    {
+        std::mt19937 rng(seed);
+        auto random = [&rng]() { return static_cast<float>(rng()) / static_cast<float>(std::mt19937::max()) * 2.f - 1.f; };
+
+        IndexedMesh mesh;
+        mesh.positions.resize(3 * size_t(count));
+        mesh.normals.resize(count);
+        mesh.triangles.resize(count);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            glm::vec4 centre(random(), random(), random(), 1.f);
+            glm::vec4 *points = &mesh.positions[3 * size_t(i)];
+            for (uint32_t corner = 0; corner < 3; corner++)
+            {
+                points[corner] = centre + glm::vec4(random(), random(), random(), 0.f) * triangleSize;
+                mesh.triangles[i].position[corner] = 3 * i + corner;
+                mesh.triangles[i].normal[corner] = i;
+            }
+
+            glm::vec3 e1 = points[1] - points[0];
+            glm::vec3 e2 = points[2] - points[0];
+            mesh.normals[i] = glm::vec4(glm::normalize(glm::cross(e2, e1)), 0.0);
+        }
+
+        return mesh;
+    }
+
+    inline NodeTLAS mergeBounds(const NodeTLAS &b1, const NodeTLAS &b2)
     {
         NodeTLAS ret{glm::vec4(std::min(b1.first.x, b2.first.x),
                                std::min(b1.first.y, b2.first.y),
@@ -323,43 +666,209 @@ namespace Primitives
         return ret;
     }
 
-    NodeTLAS blasBounds(const NodeBLAS node)
+    inline NodeTLAS triangleBounds(const glm::vec4 &point1, const glm::vec4 &point2, const glm::vec4 &point3)
     {
-        glm::vec4 min(std::min({node.point1.x, node.point2.x, node.point3.x}),
-                      std::min({node.point1.y, node.point2.y, node.point3.y}),
-                      std::min({node.point1.z, node.point2.z, node.point3.z}),
+        glm::vec4 min(std::min({point1.x, point2.x, point3.x}),
+                      std::min({point1.y, point2.y, point3.y}),
+                      std::min({point1.z, point2.z, point3.z}),
                       1.);
 
-        glm::vec4 max(std::max({node.point1.x, node.point2.x, node.point3.x}),
-                      std::max({node.point1.y, node.point2.y, node.point3.y}),
-                      std::max({node.point1.z, node.point2.z, node.point3.z}),
+        glm::vec4 max(std::max({point1.x, point2.x, point3.x}),
+                      std::max({point1.y, point2.y, point3.y}),
+                      std::max({point1.z, point2.z, point3.z}),
                       1.);
 
         return NodeTLAS{min, max};
     }
 
-    glm::vec4 boundsCentroid(const NodeBLAS &shape)
+    inline glm::vec4 boundsCentroid(const NodeTLAS &shape)
     {
-        return .5f * blasBounds(shape).first + .5f * blasBounds(shape).second;
+        return .5f * shape.first + .5f * shape.second;
     }
 
-    void recursiveBuild(std::vector<NodeTLAS> &tlas, std::vector<NodeBLAS> &blas, std::vector<NodeBLAS> &triangleParamsUnsorted, uint32_t level, uint32_t branch, uint32_t start, uint32_t end, uint32_t tlasHeight)
+    inline float surfaceArea(const NodeTLAS &bounds)
     {
-        //    uint32_t node = (std::pow(2, level) - 1) + branch;
-        NodeBLAS emptyNode{glm::vec4(-1.f), glm::vec4(-1.f), glm::vec4(-1.f), glm::vec4(-1.f), glm::vec4(-1.f), glm::vec4(-1.f)};
-        NodeTLAS emptyBounds{glm::vec4(std::numeric_limits<float>::min()), glm::vec4(std::numeric_limits<float>::min())};
-//        NodeTLAS totalBounds{glm::vec4(std::numeric_limits<float>::min()), glm::vec4(std::numeric_limits<float>::max())};
+        glm::vec4 d = bounds.second - bounds.first;
+        if (d.x < 0.f || d.y < 0.f || d.z < 0.f)
+            return 0.f;
+
+        return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
 
-        NodeTLAS centroidBounds{
+    inline NodeTLAS emptyBoundsUnion()
+    {
+        return NodeTLAS{
             glm::vec4(std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(), 1.f),
             glm::vec4(-std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(), 1.f)};
+    }
+
+    inline uint32_t sahBinIndex(const NodeTLAS &shape, uint32_t axis, const NodeTLAS &centroidBounds, uint32_t binCount)
+    {
+        float extent = centroidBounds.second[axis] - centroidBounds.first[axis];
+        float offset = (boundsCentroid(shape)[axis] - centroidBounds.first[axis]) / extent;
+        uint32_t bin = static_cast<uint32_t>(offset * binCount);
+
+        return std::min(bin, binCount - 1);
+    }
+
+    //  Maps [start, end) to one value per chunk of grainSize and folds the chunks in order. Without a pool, or for
+    //  small ranges, the whole range is mapped on the calling thread. The reductions used by the BVH builders are
+    //  min, max and integer sums, which are exact, so the result is the same however the range was chunked.
+    template <typename T, typename Map, typename Reduce>
+    T chunkedReduce(ThreadPool *pool, uint32_t start, uint32_t end, uint32_t grainSize, const T &identity, Map map, Reduce reduce)
+    {
+        if (pool == nullptr || grainSize == 0 || end - start <= grainSize)
+            return map(start, end);
 
-        for (auto it = triangleParamsUnsorted.begin() + start; it != triangleParamsUnsorted.begin() + end; ++it)
+        std::vector<T> partial((end - start + grainSize - 1) / grainSize, identity);
+        pool->parallelFor(start, end, grainSize, [&](uint32_t chunkBegin, uint32_t chunkEnd) {
+            partial[(chunkBegin - start) / grainSize] = map(chunkBegin, chunkEnd);
+        });
+
+        T result = identity;
+        for (const T &value : partial)
         {
-            centroidBounds = mergeBounds(centroidBounds, blasBounds(*it));
-        };
+            result = reduce(result, value);
+        }
+
+        return result;
+    }
+
+    inline NodeTLAS rangeBounds(ThreadPool *pool, const std::vector<NodeTLAS> &primitives, uint32_t start, uint32_t end, uint32_t grainSize)
+    {
+        return chunkedReduce(
+            pool, start, end, grainSize, emptyBoundsUnion(),
+            [&](uint32_t chunkBegin, uint32_t chunkEnd) {
+                NodeTLAS bounds = emptyBoundsUnion();
+                for (uint32_t i = chunkBegin; i < chunkEnd; ++i)
+                {
+                    bounds = mergeBounds(bounds, primitives[i]);
+                }
+                return bounds;
+            },
+            mergeBounds);
+    }
+
+    struct SAHBin
+    {
+        NodeTLAS bounds;
+        uint32_t count;
+    };
+
+    // Finds the cheapest binned SAH split of [start, end) and partitions the range around it.
+    // Returns the split point, or start if keeping the node as a leaf is cheaper or the centroids can't be separated.
+    inline uint32_t sahPartition(ThreadPool *pool, std::vector<NodeTLAS> &primitivesUnsorted, uint32_t start, uint32_t end, const NodeTLAS &bounds, bool canBeLeaf, const BVHSettings &settings)
+    {
+        uint32_t nShapes = end - start;
+        uint32_t binCount = std::max(settings.binCount, 2u);
+
+        NodeTLAS centroidBounds = chunkedReduce(
+            pool, start, end, settings.parallelThreshold, emptyBoundsUnion(),
+            [&](uint32_t chunkBegin, uint32_t chunkEnd) {
+                NodeTLAS chunkBounds = emptyBoundsUnion();
+                for (uint32_t i = chunkBegin; i < chunkEnd; ++i)
+                {
+                    glm::vec4 centroid = boundsCentroid(primitivesUnsorted[i]);
+                    chunkBounds = mergeBounds(chunkBounds, NodeTLAS{centroid, centroid});
+                }
+                return chunkBounds;
+            },
+            mergeBounds);
+
+        //  Bins for all three axes, axis * binCount + bin
+        std::vector<SAHBin> emptyBins(3 * binCount, SAHBin{emptyBoundsUnion(), 0});
+        std::vector<SAHBin> bins = chunkedReduce(
+            pool, start, end, settings.parallelThreshold, emptyBins,
+            [&](uint32_t chunkBegin, uint32_t chunkEnd) {
+                std::vector<SAHBin> chunkBins = emptyBins;
+                for (uint32_t axis = 0; axis < 3; ++axis)
+                {
+                    if (!(centroidBounds.second[axis] > centroidBounds.first[axis]))
+                        continue;
+
+                    for (uint32_t i = chunkBegin; i < chunkEnd; ++i)
+                    {
+                        SAHBin &bin = chunkBins[axis * binCount + sahBinIndex(primitivesUnsorted[i], axis, centroidBounds, binCount)];
+                        bin.bounds = mergeBounds(bin.bounds, primitivesUnsorted[i]);
+                        bin.count++;
+                    }
+                }
+                return chunkBins;
+            },
+            [](std::vector<SAHBin> a, const std::vector<SAHBin> &b) {
+                for (size_t i = 0; i < a.size(); ++i)
+                {
+                    a[i].bounds = mergeBounds(a[i].bounds, b[i].bounds);
+                    a[i].count += b[i].count;
+                }
+                return a;
+            });
+
+        float nodeArea = surfaceArea(bounds);
+        float bestCost = std::numeric_limits<float>::infinity();
+        uint32_t bestAxis = 0;
+        uint32_t bestBin = 0;
+
+        std::vector<float> rightAreas(binCount);
+        std::vector<uint32_t> rightCounts(binCount);
+
+        for (uint32_t axis = 0; axis < 3; ++axis)
+        {
+            if (!(centroidBounds.second[axis] > centroidBounds.first[axis]))
+                continue;
+
+            const SAHBin *axisBins = &bins[axis * binCount];
+
+            // Sweep from the right to get the area and count of every right-hand side
+            NodeTLAS accumulated = emptyBoundsUnion();
+            uint32_t count = 0;
+            for (uint32_t bin = binCount - 1; bin > 0; --bin)
+            {
+                accumulated = mergeBounds(accumulated, axisBins[bin].bounds);
+                count += axisBins[bin].count;
+                rightAreas[bin - 1] = surfaceArea(accumulated);
+                rightCounts[bin - 1] = count;
+            }
+
+            // Then from the left, evaluating the split after every bin
+            accumulated = emptyBoundsUnion();
+            count = 0;
+            for (uint32_t bin = 0; bin < binCount - 1; ++bin)
+            {
+                accumulated = mergeBounds(accumulated, axisBins[bin].bounds);
+                count += axisBins[bin].count;
+
+                if (count == 0 || rightCounts[bin] == 0)
+                    continue;
+
+                float cost = settings.traversalCost + settings.intersectionCost * (count * surfaceArea(accumulated) + rightCounts[bin] * rightAreas[bin]) / nodeArea;
+
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = bin;
+                }
+            }
+        }
+
+        if (canBeLeaf && settings.intersectionCost * nShapes <= bestCost)
+            return start;
+
+        if (bestCost == std::numeric_limits<float>::infinity())
+            return start;
+
+        auto midIt = std::partition(primitivesUnsorted.begin() + start, primitivesUnsorted.begin() + end,
+                                    [&](const NodeTLAS &shape) {
+                                        return sahBinIndex(shape, bestAxis, centroidBounds, binCount) <= bestBin;
+                                    });
 
-        glm::vec4 diagonal = centroidBounds.second - centroidBounds.first;
+        return static_cast<uint32_t>(midIt - primitivesUnsorted.begin());
+    }
+
+    inline uint32_t medianPartition(std::vector<NodeTLAS> &primitivesUnsorted, uint32_t start, uint32_t end, const NodeTLAS &bounds)
+    {
+        glm::vec4 diagonal = bounds.second - bounds.first;
         uint32_t splitDimension;
 
         if (diagonal.x > diagonal.y && diagonal.x > diagonal.z)
@@ -369,150 +878,1407 @@ namespace Primitives
         else
             splitDimension = 2;
 
-        //        int mid = (start + end) / 2;
+        uint32_t mid = (start + end) / 2;
+        std::nth_element(&primitivesUnsorted[start], &primitivesUnsorted[mid],
+                         &primitivesUnsorted[end - 1] + 1,
+                         [splitDimension](const NodeTLAS &a, const NodeTLAS &b) {
+                             return boundsCentroid(a)[splitDimension] < boundsCentroid(b)[splitDimension];
+                         });
+
+        return mid;
+    }
+
+    //  Splits [start, end) in place and returns the split point, or start if the node becomes a leaf
+    inline uint32_t partitionNode(ThreadPool *pool, std::vector<NodeTLAS> &primitivesUnsorted, uint32_t depth, uint32_t start, uint32_t end, const NodeTLAS &bounds, const BVHSettings &settings)
+    {
+        uint32_t nShapes = end - start;
+        uint32_t leafSize = std::max(settings.maxLeafSize, 1u);
+
+        //  Past the traversal stack limit of the shader everything left goes into one leaf
+        if (depth + 1 >= BVH_MAX_DEPTH || nShapes <= 1)
+            return start;
 
-        if (centroidBounds.first[splitDimension] == centroidBounds.second[splitDimension])
+        if (settings.mode == BVHBuildMode::SAH)
         {
-            //            TODO figure out if this bit is necessary.
-            //            for (int i = start; i < end; ++i)
-            //            {
-            //                //                node->addChild(shapes.at(i));
-            //
-            //            }
-            return;
+            uint32_t mid = sahPartition(pool, primitivesUnsorted, start, end, bounds, nShapes <= leafSize, settings);
+
+            if (mid == start && nShapes > leafSize)
+            {
+                mid = medianPartition(primitivesUnsorted, start, end, bounds);
+            }
+
+            return mid;
         }
-        else
-        {
-            int mid = (start + end) / 2;
-            std::nth_element(&triangleParamsUnsorted[start], &triangleParamsUnsorted[mid],
-                             &triangleParamsUnsorted[end-1]+1,
-                             [splitDimension](const NodeBLAS &a, const NodeBLAS &b) {
-                                 return boundsCentroid(a)[splitDimension] < boundsCentroid(b)[splitDimension];
-                             });
 
-            uint32_t node = std::pow(2, level) + branch - 1;
-            tlas.at(node) = centroidBounds;
-            
-            int nShapes = end - start;
+        return nShapes > leafSize ? medianPartition(primitivesUnsorted, start, end, bounds) : start;
+    }
+
+    inline void setNodeOffsets(NodeTLAS &node, uint32_t offset, uint32_t count)
+    {
+        memcpy(&node.first.w, &offset, sizeof(uint32_t));
+        memcpy(&node.second.w, &count, sizeof(uint32_t));
+    }
+
+    inline uint32_t nodeOffset(const NodeTLAS &node)
+    {
+        uint32_t offset;
+        memcpy(&offset, &node.first.w, sizeof(uint32_t));
+        return offset;
+    }
+
+    inline uint32_t nodeCount(const NodeTLAS &node)
+    {
+        uint32_t count;
+        memcpy(&count, &node.second.w, sizeof(uint32_t));
+        return count;
+    }
 
-            if (nShapes > 2)
+    //  Bounds of every triangle with the triangle's index in first.w. The builders reorder these instead of the
+    //  triangles, the indices then tell which triangle each leaf covers.
+    inline std::vector<NodeTLAS> primitiveBounds(const IndexedMesh &mesh)
+    {
+        std::vector<NodeTLAS> primitives(mesh.triangles.size());
+        ThreadPool::global().parallelFor(0, primitives.size(), 4096, [&](uint32_t primitiveBegin, uint32_t primitiveEnd) {
+            for (uint32_t i = primitiveBegin; i < primitiveEnd; i++)
             {
-                recursiveBuild(tlas, blas, triangleParamsUnsorted, level + 1, branch * 2, start, mid, tlasHeight);
-                recursiveBuild(tlas, blas, triangleParamsUnsorted, level + 1, (branch * 2) + 1, mid, end, tlasHeight); //TODO check branch calc
+                const IndexedTriangle &triangle = mesh.triangles[i];
+                primitives[i] = triangleBounds(mesh.positions[triangle.position[0]], mesh.positions[triangle.position[1]], mesh.positions[triangle.position[2]]);
+                setNodeOffsets(primitives[i], i, 0);
             }
-            else
-            {
-                blas.push_back(triangleParamsUnsorted.at(start));
-                //
-                if (nShapes == 2)
-                {
-                    blas.push_back(triangleParamsUnsorted.at(start + 1));
-                }
-                else
-                {
-                    //          If there is only one leaf node, just add it twice to make all inner nodes have 2 children
-                    //                    blas.push_back(triangleParamsUnsorted.at(start));
-                    //                  Instead of adding it twice, add node with w value 0 and check in shader
-                    blas.push_back(emptyNode);
-
-                    //                  TODO: need to use sorted triangleParams array instead of this push approach, but also need to track emptynodes
+        });
 
-                    //                paddingIndices.push_back(((node-offset)*2)+1);
-                }
+        return primitives;
+    }
 
-                //            In case on unbalanced tree, add dummy branches
-                if (level < tlasHeight)
-                {
-                    level += 1;
-                    branch *= 2;
+    inline uint32_t recursiveBuild(std::vector<NodeTLAS> &tlas, std::vector<NodeTLAS> &primitivesUnsorted, uint32_t depth, uint32_t start, uint32_t end, const BVHSettings &settings, BVHStats &stats)
+    {
+        NodeTLAS bounds = rangeBounds(nullptr, primitivesUnsorted, start, end, 0);
 
-                    uint32_t dummyNode = std::pow(2, level) + branch - 1;
+        uint32_t node = tlas.size();
+        tlas.push_back(bounds);
+        stats.maxDepth = std::max(stats.maxDepth, depth);
 
-                    tlas.at(dummyNode) = centroidBounds;
-                    tlas.at(dummyNode + 1) = emptyBounds;
+        uint32_t nShapes = end - start;
+        uint32_t mid = partitionNode(nullptr, primitivesUnsorted, depth, start, end, bounds, settings);
 
-                    blas.push_back(emptyNode);
-                    blas.push_back(emptyNode);
-                    
-                }
+        if (mid == start)
+        {
+            stats.leafNodes++;
+            stats.sahCost += settings.intersectionCost * nShapes * surfaceArea(bounds);
 
-                return;
-            }
+            setNodeOffsets(tlas[node], start, nShapes);
+            return node;
         }
 
-        return;
+        stats.interiorNodes++;
+        stats.sahCost += settings.traversalCost * surfaceArea(bounds);
+
+        //  The left child always directly follows its parent, only the right one needs an explicit index
+        recursiveBuild(tlas, primitivesUnsorted, depth + 1, start, mid, settings, stats);
+        uint32_t rightChild = recursiveBuild(tlas, primitivesUnsorted, depth + 1, mid, end, settings, stats);
+
+        setNodeOffsets(tlas[node], rightChild, 0);
+        return node;
     }
 
-    uint32_t nextPowerOfTwo(uint32_t v)
+    //  Node of the tree above BVHSettings::parallelThreshold. Subtrees below the threshold are built serially into
+    //  their own node array, indexed from their root, and spliced into the TLAS once the whole tree is done.
+    struct BuildTask
     {
-        v--;
-        v |= v >> 1;
-        v |= v >> 2;
-        v |= v >> 4;
-        v |= v >> 8;
-        v |= v >> 16;
-        v++;
-        return v;
-    }
+        NodeTLAS bounds;
+        std::unique_ptr<BuildTask> left;
+        std::unique_ptr<BuildTask> right;
+        std::vector<NodeTLAS> subtree;
+        BVHStats stats;
+    };
 
-    static uint32_t log2int(uint32_t val)
+    inline void parallelBuild(ThreadPool &pool, BuildTask &task, std::vector<NodeTLAS> &primitivesUnsorted, uint32_t depth, uint32_t start, uint32_t end, const BVHSettings &settings)
     {
-        if (val == 0)
-            return std::numeric_limits<uint32_t>::max();
-        if (val == 1)
-            return 0;
-        uint32_t ret = 0;
-        while (val > 1)
+        if (end - start <= settings.parallelThreshold)
         {
-            val >>= 1;
-            ret++;
+            task.subtree.reserve(2 * (end - start) - 1);
+            recursiveBuild(task.subtree, primitivesUnsorted, depth, start, end, settings, task.stats);
+            return;
         }
-        return ret;
+
+        task.bounds = rangeBounds(&pool, primitivesUnsorted, start, end, settings.parallelThreshold);
+        uint32_t mid = partitionNode(&pool, primitivesUnsorted, depth, start, end, task.bounds, settings);
+
+        if (mid == start)
+        {
+            //  Only happens at the depth limit, the serial build makes the same leaf
+            recursiveBuild(task.subtree, primitivesUnsorted, depth, start, end, settings, task.stats);
+            return;
+        }
+
+        task.stats.maxDepth = depth;
+        task.stats.interiorNodes++;
+        task.stats.sahCost += settings.traversalCost * surfaceArea(task.bounds);
+
+        task.left = std::make_unique<BuildTask>();
+        task.right = std::make_unique<BuildTask>();
+
+        ThreadPool::TaskGroup group;
+        pool.spawn(group, [&]() { parallelBuild(pool, *task.left, primitivesUnsorted, depth + 1, start, mid, settings); });
+        pool.spawn(group, [&]() { parallelBuild(pool, *task.right, primitivesUnsorted, depth + 1, mid, end, settings); });
+        pool.wait(group);
     }
 
-    std::vector<NodeTLAS> buildTLAS(std::vector<NodeBLAS> &blas, std::vector<NodeBLAS> &triangleParamsUnsorted)
+    //  Emits the nodes in the same depth-first order as recursiveBuild, so the result matches the serial build bit for bit
+    inline void flattenBuildTask(const BuildTask &task, std::vector<NodeTLAS> &tlas, BVHStats &stats)
     {
-        std::vector<NodeTLAS> tlas;
-        tlas.resize(nextPowerOfTwo(triangleParamsUnsorted.size()) - 1);
+        stats.interiorNodes += task.stats.interiorNodes;
+        stats.leafNodes += task.stats.leafNodes;
+        stats.maxDepth = std::max(stats.maxDepth, task.stats.maxDepth);
+        stats.sahCost += task.stats.sahCost;
+
+        if (!task.left)
+        {
+            uint32_t base = tlas.size();
+            for (NodeTLAS node : task.subtree)
+            {
+                if (nodeCount(node) == 0)
+                {
+                    setNodeOffsets(node, nodeOffset(node) + base, 0);
+                }
+                tlas.push_back(node);
+            }
+            return;
+        }
 
-        uint32_t tlasHeight = log2int(triangleParamsUnsorted.size());
+        uint32_t node = tlas.size();
+        tlas.push_back(task.bounds);
 
-        //    size_t offset = std::pow(2,std::floor(log2(tlas.size())))-1;
+        flattenBuildTask(*task.left, tlas, stats);
+        uint32_t rightChild = tlas.size();
+        flattenBuildTask(*task.right, tlas, stats);
 
-        recursiveBuild(tlas, blas, triangleParamsUnsorted, 0, 0, 0, triangleParamsUnsorted.size(), tlasHeight);
+        setNodeOffsets(tlas[node], rightChild, 0);
+    }
 
-        return tlas;
+    inline uint32_t countLeadingZeros(uint32_t value)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        return _BitScanReverse(&index, value) ? 31 - index : 32;
+#else
+        return value == 0 ? 32 : __builtin_clz(value);
+#endif
+    }
+
+    inline uint32_t countLeadingZeros(uint64_t value)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        return _BitScanReverse64(&index, value) ? 63 - index : 64;
+#else
+        return value == 0 ? 64 : __builtin_clzll(value);
+#endif
+    }
+
+    //  Spreads the low 10 bits of v so there are two zero bits between each of them
+    inline uint32_t expandBits10(uint32_t v)
+    {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
     }
 
-    std::pair<BVH *, std::vector<NodeBLAS>> makeBVH(std::string const &path, Material &material, glm::mat4 &transform, size_t &size)
+    //  Spreads the low 21 bits of v so there are two zero bits between each of them
+    inline uint64_t expandBits21(uint64_t v)
     {
-        std::vector<NodeBLAS> triangleParamsUnsorted = parseObjFile(path);
-        size_t blasSizeParams = triangleParamsUnsorted.size() * sizeof(NodeBLAS);
+        v &= 0x1FFFFFull;
+        v = (v | v << 32) & 0x1F00000000FFFFull;
+        v = (v | v << 16) & 0x1F0000FF0000FFull;
+        v = (v | v << 8) & 0x100F00F00F00F00Full;
+        v = (v | v << 4) & 0x10C30C30C30C30C3ull;
+        v = (v | v << 2) & 0x1249249249249249ull;
+        return v;
+    }
 
-        std::vector<NodeBLAS> blas;
-        blas.reserve(nextPowerOfTwo(triangleParamsUnsorted.size()) - 1);
+    //  position is the centroid normalised to [0, 1] within the centroid bounds of the mesh
+    inline void mortonCode(const glm::vec4 &position, uint32_t &code)
+    {
+        uint32_t x = static_cast<uint32_t>(std::min(std::max(position.x * 1024.f, 0.f), 1023.f));
+        uint32_t y = static_cast<uint32_t>(std::min(std::max(position.y * 1024.f, 0.f), 1023.f));
+        uint32_t z = static_cast<uint32_t>(std::min(std::max(position.z * 1024.f, 0.f), 1023.f));
+        code = (expandBits10(x) << 2) | (expandBits10(y) << 1) | expandBits10(z);
+    }
 
-        std::vector<NodeTLAS> tlas = buildTLAS(blas, triangleParamsUnsorted);
-        size_t tlasSizeParams = tlas.size() * sizeof(NodeTLAS);
+    inline void mortonCode(const glm::vec4 &position, uint64_t &code)
+    {
+        uint64_t x = static_cast<uint64_t>(std::min(std::max(position.x * 2097152.f, 0.f), 2097151.f));
+        uint64_t y = static_cast<uint64_t>(std::min(std::max(position.y * 2097152.f, 0.f), 2097151.f));
+        uint64_t z = static_cast<uint64_t>(std::min(std::max(position.z * 2097152.f, 0.f), 2097151.f));
+        code = (expandBits21(x) << 2) | (expandBits21(y) << 1) | expandBits21(z);
+    }
 
-        //    NodeBLAS emptyNode {glm::vec4(0.f),glm::vec4(0.f),glm::vec4(0.f),glm::vec4(0.f),glm::vec4(0.f),glm::vec4(0.f)};
-        //    for (auto idx: paddingIndices) {
-        //        auto it = triangleParamsUnsorted.begin();
-        //        std::advance(it,idx);
-        //        triangleParamsUnsorted.insert(it, emptyNode);
-        //    }
+    //  Stable LSD radix sort of keys, carrying values along, eight bits per pass. Every pass builds a histogram per
+    //  chunk in parallel and scatters each chunk to its own precomputed offsets, so the result doesn't depend on threading.
+    template <typename Key>
+    void parallelRadixSort(ThreadPool *pool, std::vector<Key> &keys, std::vector<uint32_t> &values, uint32_t significantBits, uint32_t grainSize)
+    {
+        uint32_t n = keys.size();
+        grainSize = std::max(grainSize, 1u);
+        uint32_t chunkCount = (n + grainSize - 1) / grainSize;
 
-        //    size = sizeof(BVH) + tlasSizeParams;
-        size = sizeof(BVH) - sizeof(NodeTLAS) + tlasSizeParams;
+        std::vector<Key> keysOut(n);
+        std::vector<uint32_t> valuesOut(n);
+        std::vector<uint32_t> offsets(chunkCount * 256);
 
-        char *ptr = new char[size];
-        BVH *bvh = reinterpret_cast<BVH *>(ptr);
-        bvh->inverseTransform = glm::affineInverse(transform);
-        bvh->material = material;
+        auto forEachChunk = [&](const std::function<void(uint32_t, uint32_t)> &body) {
+            if (pool != nullptr && chunkCount > 1)
+            {
+                pool->parallelFor(0, n, grainSize, body);
+            }
+            else
+            {
+                for (uint32_t chunkBegin = 0; chunkBegin < n; chunkBegin += grainSize)
+                {
+                    body(chunkBegin, std::min(chunkBegin + grainSize, n));
+                }
+            }
+        };
 
-        memcpy(bvh->TLAS, tlas.data(), tlasSizeParams);
+        for (uint32_t shift = 0; shift < significantBits; shift += 8)
+        {
+            std::fill(offsets.begin(), offsets.end(), 0);
 
-        return {bvh, blas};
+            forEachChunk([&](uint32_t chunkBegin, uint32_t chunkEnd) {
+                uint32_t *histogram = &offsets[(chunkBegin / grainSize) * 256];
+                for (uint32_t i = chunkBegin; i < chunkEnd; ++i)
+                {
+                    histogram[(keys[i] >> shift) & 0xFF]++;
+                }
+            });
+
+            //  Exclusive prefix sum in digit-major, chunk-minor order keeps the sort stable
+            uint32_t sum = 0;
+            for (uint32_t digit = 0; digit < 256; ++digit)
+            {
+                for (uint32_t chunk = 0; chunk < chunkCount; ++chunk)
+                {
+                    uint32_t count = offsets[chunk * 256 + digit];
+                    offsets[chunk * 256 + digit] = sum;
+                    sum += count;
+                }
+            }
+
+            forEachChunk([&](uint32_t chunkBegin, uint32_t chunkEnd) {
+                uint32_t *offset = &offsets[(chunkBegin / grainSize) * 256];
+                for (uint32_t i = chunkBegin; i < chunkEnd; ++i)
+                {
+                    uint32_t destination = offset[(keys[i] >> shift) & 0xFF]++;
+                    keysOut[destination] = keys[i];
+                    valuesOut[destination] = values[i];
+                }
+            });
+
+            keys.swap(keysOut);
+            values.swap(valuesOut);
+        }
+    }
+
+    //  Interior node of the Karras radix tree, covering the sorted triangles [first, last]
+    struct LBVHNode
+    {
+        uint32_t first;
+        uint32_t last;
+        uint32_t split; // the left child covers [first, split], the right one [split + 1, last]
+    };
+
+    //  Length of the common prefix of the codes at i and j, falling back to the indices for equal codes, -1 out of range
+    template <typename Key>
+    int32_t commonPrefix(const std::vector<Key> &codes, int64_t i, int64_t j)
+    {
+        if (j < 0 || j >= static_cast<int64_t>(codes.size()))
+            return -1;
+
+        if (codes[i] == codes[j])
+            return 8 * sizeof(Key) + countLeadingZeros(static_cast<uint32_t>(i ^ j));
+
+        return countLeadingZeros(static_cast<Key>(codes[i] ^ codes[j]));
+    }
+
+    //  Karras, "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees", 2012
+    template <typename Key>
+    LBVHNode karrasNode(const std::vector<Key> &codes, int64_t i)
+    {
+        int64_t direction = commonPrefix(codes, i, i + 1) - commonPrefix(codes, i, i - 1) >= 0 ? 1 : -1;
+        int32_t minPrefix = commonPrefix(codes, i, i - direction);
+
+        //  Upper bound for the length of the range, then binary search for the other end
+        int64_t maxLength = 2;
+        while (commonPrefix(codes, i, i + maxLength * direction) > minPrefix)
+        {
+            maxLength *= 2;
+        }
+
+        int64_t length = 0;
+        for (int64_t step = maxLength / 2; step >= 1; step /= 2)
+        {
+            if (commonPrefix(codes, i, i + (length + step) * direction) > minPrefix)
+                length += step;
+        }
+
+        int64_t j = i + length * direction;
+        int32_t nodePrefix = commonPrefix(codes, i, j);
+
+        //  Binary search for the last index sharing more than nodePrefix bits with i
+        int64_t split = 0;
+        for (int64_t divisor = 2;; divisor *= 2)
+        {
+            int64_t step = (length + divisor - 1) / divisor;
+            if (commonPrefix(codes, i, i + (split + step) * direction) > nodePrefix)
+                split += step;
+
+            if (step <= 1)
+                break;
+        }
+
+        LBVHNode node;
+        node.first = static_cast<uint32_t>(std::min(i, j));
+        node.last = static_cast<uint32_t>(std::max(i, j));
+        node.split = static_cast<uint32_t>(i + split * direction + std::min<int64_t>(direction, 0));
+
+        return node;
+    }
+
+    //  Emits the subtree covering [first, last] depth-first and returns its bounds. Ranges of more than one
+    //  triangle belong to the interior node radixIndex.
+    inline NodeTLAS emitLBVHNode(std::vector<NodeTLAS> &tlas, const std::vector<LBVHNode> &radixTree, const std::vector<NodeTLAS> &primitives, uint32_t radixIndex, uint32_t first, uint32_t last, uint32_t depth, const BVHSettings &settings, BVHStats &stats)
+    {
+        uint32_t node = tlas.size();
+        tlas.emplace_back();
+        stats.maxDepth = std::max(stats.maxDepth, depth);
+
+        uint32_t nShapes = last - first + 1;
+
+        if (nShapes <= std::max(settings.maxLeafSize, 1u) || depth + 1 >= BVH_MAX_DEPTH)
+        {
+            NodeTLAS bounds = rangeBounds(nullptr, primitives, first, last + 1, 0);
+
+            stats.leafNodes++;
+            stats.sahCost += settings.intersectionCost * nShapes * surfaceArea(bounds);
+
+            tlas[node] = bounds;
+            setNodeOffsets(tlas[node], first, nShapes);
+            return bounds;
+        }
+
+        //  The left child ends at the split and the right one starts right after it, which makes them interior nodes split and split + 1
+        uint32_t split = radixTree[radixIndex].split;
+
+        NodeTLAS leftBounds = emitLBVHNode(tlas, radixTree, primitives, split, first, split, depth + 1, settings, stats);
+        uint32_t rightChild = tlas.size();
+        NodeTLAS rightBounds = emitLBVHNode(tlas, radixTree, primitives, split + 1, split + 1, last, depth + 1, settings, stats);
+
+        NodeTLAS bounds = mergeBounds(leftBounds, rightBounds);
+
+        stats.interiorNodes++;
+        stats.sahCost += settings.traversalCost * surfaceArea(bounds);
+
+        tlas[node] = bounds;
+        setNodeOffsets(tlas[node], rightChild, 0);
+        return bounds;
+    }
+
+    template <typename Key>
+    std::vector<NodeTLAS> buildLBVH(ThreadPool *pool, std::vector<NodeTLAS> &primitives, const BVHSettings &settings, BVHStats &stats)
+    {
+        uint32_t n = primitives.size();
+        uint32_t grainSize = settings.parallelThreshold;
+
+        auto forRange = [&](uint32_t count, const std::function<void(uint32_t, uint32_t)> &body) {
+            if (pool != nullptr && grainSize > 0 && count > grainSize)
+                pool->parallelFor(0, count, grainSize, body);
+            else
+                body(0, count);
+        };
+
+        NodeTLAS centroidBounds = chunkedReduce(
+            pool, 0, n, grainSize, emptyBoundsUnion(),
+            [&](uint32_t chunkBegin, uint32_t chunkEnd) {
+                NodeTLAS chunkBounds = emptyBoundsUnion();
+                for (uint32_t i = chunkBegin; i < chunkEnd; ++i)
+                {
+                    glm::vec4 centroid = boundsCentroid(primitives[i]);
+                    chunkBounds = mergeBounds(chunkBounds, NodeTLAS{centroid, centroid});
+                }
+                return chunkBounds;
+            },
+            mergeBounds);
+
+        glm::vec4 extent = centroidBounds.second - centroidBounds.first;
+        glm::vec4 scale(extent.x > 0.f ? 1.f / extent.x : 0.f, extent.y > 0.f ? 1.f / extent.y : 0.f, extent.z > 0.f ? 1.f / extent.z : 0.f, 0.f);
+
+        std::vector<Key> codes(n);
+        std::vector<uint32_t> order(n);
+        forRange(n, [&](uint32_t chunkBegin, uint32_t chunkEnd) {
+            for (uint32_t i = chunkBegin; i < chunkEnd; ++i)
+            {
+                mortonCode((boundsCentroid(primitives[i]) - centroidBounds.first) * scale, codes[i]);
+                order[i] = i;
+            }
+        });
+
+        parallelRadixSort(pool, codes, order, sizeof(Key) == 4 ? 30 : 63, grainSize > 0 ? grainSize : n);
+
+        std::vector<NodeTLAS> sorted(n);
+        forRange(n, [&](uint32_t chunkBegin, uint32_t chunkEnd) {
+            for (uint32_t i = chunkBegin; i < chunkEnd; ++i)
+            {
+                sorted[i] = primitives[order[i]];
+            }
+        });
+        primitives.swap(sorted);
+
+        //  Interior node i of the radix tree covers a range that starts or ends at triangle i
+        std::vector<LBVHNode> radixTree(n - 1);
+        forRange(n - 1, [&](uint32_t chunkBegin, uint32_t chunkEnd) {
+            for (uint32_t i = chunkBegin; i < chunkEnd; ++i)
+            {
+                radixTree[i] = karrasNode(codes, i);
+            }
+        });
+
+        std::vector<NodeTLAS> tlas;
+        tlas.reserve(2 * n - 1);
+        emitLBVHNode(tlas, radixTree, primitives, 0, 0, n - 1, 0, settings, stats);
+
+        return tlas;
+    }
+
+    //  Builds the TLAS over the triangle bounds from primitiveBounds, reordering them so every leaf covers a contiguous range
+    inline std::vector<NodeTLAS> buildTLAS(std::vector<NodeTLAS> &primitives, const BVHSettings &settings, BVHStats &stats)
+    {
+        std::vector<NodeTLAS> tlas;
+        stats = BVHStats{};
+
+        if (primitives.empty())
+            return tlas;
+
+        bool parallel = settings.parallelThreshold > 0 && primitives.size() > settings.parallelThreshold;
+
+        if (settings.mode == BVHBuildMode::LBVH)
+        {
+            ThreadPool *pool = parallel ? &ThreadPool::global() : nullptr;
+            tlas = settings.mortonBits > 30 ? buildLBVH<uint64_t>(pool, primitives, settings, stats) : buildLBVH<uint32_t>(pool, primitives, settings, stats);
+        }
+        else if (!parallel)
+        {
+            tlas.reserve(2 * primitives.size() - 1);
+            recursiveBuild(tlas, primitives, 0, 0, primitives.size(), settings, stats);
+        }
+        else
+        {
+            BuildTask root;
+            parallelBuild(ThreadPool::global(), root, primitives, 0, 0, primitives.size(), settings);
+            tlas.reserve(2 * primitives.size() - 1);
+            flattenBuildTask(root, tlas, stats);
+        }
+
+        tlas.shrink_to_fit();
+
+        float rootArea = surfaceArea(tlas.front());
+        stats.sahCost = rootArea > 0.f ? stats.sahCost / rootArea : 0.f;
+
+        return tlas;
+    }
+
+    template <uint32_t N>
+    inline void setWideChild(NodeWide<N> &wideNode, uint32_t slot, const NodeTLAS &bounds, uint32_t child, uint32_t count)
+    {
+        wideNode.minX[slot] = bounds.first.x;
+        wideNode.minY[slot] = bounds.first.y;
+        wideNode.minZ[slot] = bounds.first.z;
+        wideNode.maxX[slot] = bounds.second.x;
+        wideNode.maxY[slot] = bounds.second.y;
+        wideNode.maxZ[slot] = bounds.second.z;
+        wideNode.child[slot] = child;
+        wideNode.count[slot] = count;
+    }
+
+    //  Pulls up to N children of the binary node into one wide node by repeatedly opening the interior child with the
+    //  largest surface area, then collapses the interior children that remain. Wide nodes are stored depth-first.
+    template <uint32_t N>
+    inline uint32_t collapseNode(const std::vector<NodeTLAS> &tlas, std::vector<NodeWide<N>> &wide, uint32_t node, uint32_t depth, BVHStats &stats)
+    {
+        uint32_t wideIdx = wide.size();
+        wide.emplace_back();
+        stats.wideDepth = std::max(stats.wideDepth, depth);
+
+        const float inf = std::numeric_limits<float>::infinity();
+        NodeTLAS emptyBox{glm::vec4(inf, inf, inf, 0.f), glm::vec4(inf, inf, inf, 0.f)};
+        for (uint32_t slot = 0; slot < N; slot++)
+            setWideChild(wide[wideIdx], slot, emptyBox, 0, 0);
+
+        //  Only a tree made of a single leaf has a leaf at the root
+        uint32_t children[N] = {node};
+        uint32_t childCount = 1;
+        if (nodeCount(tlas[node]) == 0)
+        {
+            children[0] = node + 1;
+            children[1] = nodeOffset(tlas[node]);
+            childCount = 2;
+        }
+
+        while (childCount < N)
+        {
+            int32_t largest = -1;
+            for (uint32_t i = 0; i < childCount; i++)
+            {
+                if (nodeCount(tlas[children[i]]) == 0 && (largest < 0 || surfaceArea(tlas[children[i]]) > surfaceArea(tlas[children[largest]])))
+                    largest = i;
+            }
+
+            if (largest < 0)
+                break;
+
+            uint32_t opened = children[largest];
+            children[largest] = opened + 1;
+            children[childCount++] = nodeOffset(tlas[opened]);
+        }
+
+        for (uint32_t slot = 0; slot < childCount; slot++)
+        {
+            const NodeTLAS &child = tlas[children[slot]];
+            if (nodeCount(child) > 0)
+            {
+                setWideChild(wide[wideIdx], slot, child, nodeOffset(child), nodeCount(child));
+            }
+            else
+            {
+                uint32_t childIdx = collapseNode(tlas, wide, children[slot], depth + 1, stats);
+                setWideChild(wide[wideIdx], slot, child, childIdx, 0);
+            }
+        }
+
+        return wideIdx;
+    }
+
+    //  Collapses the binary TLAS into N-wide nodes, the triangles stay in the same order
+    template <uint32_t N>
+    inline std::vector<NodeWide<N>> collapseBVH(const std::vector<NodeTLAS> &tlas, BVHStats &stats)
+    {
+        std::vector<NodeWide<N>> wide;
+        if (tlas.empty())
+            return wide;
+
+        wide.reserve(tlas.size() / (N - 1) + 1);
+        collapseNode(tlas, wide, 0, 0, stats);
+        stats.wideNodes = wide.size();
+
+        return wide;
+    }
+
+    //  Child boxes of a wide node quantized relative to their union. The scale of each axis is the smallest power of two
+    //  that fits the union in 255 steps, then every bound is moved outwards until the decoded value contains it.
+    template <uint32_t N>
+    inline NodeQuantized<N> quantizeNode(const NodeWide<N> &node)
+    {
+        NodeQuantized<N> quantized{};
+
+        //  collapseNode fills the slots in order, unused ones have an empty box at +infinity
+        uint32_t used = 0;
+        while (used < N && node.minX[used] < std::numeric_limits<float>::infinity())
+            used++;
+
+        const float *mins[3] = {node.minX, node.minY, node.minZ};
+        const float *maxs[3] = {node.maxX, node.maxY, node.maxZ};
+        uint8_t *qMins[3] = {quantized.qMinX, quantized.qMinY, quantized.qMinZ};
+        uint8_t *qMaxs[3] = {quantized.qMaxX, quantized.qMaxY, quantized.qMaxZ};
+
+        for (uint32_t axis = 0; axis < 3; axis++)
+        {
+            float lo = used > 0 ? *std::min_element(mins[axis], mins[axis] + used) : 0.f;
+            float hi = used > 0 ? *std::max_element(maxs[axis], maxs[axis] + used) : 0.f;
+
+            //  255 * 2^119 is the largest range that doesn't overflow
+            int exponent;
+            std::frexp((hi - lo) / 255.f, &exponent);
+            exponent = std::min(std::max(exponent, -126), 119);
+            while (exponent < 119 && lo + std::ldexp(255.f, exponent) < hi)
+                exponent++;
+
+            float scale = std::ldexp(1.f, exponent);
+            quantized.origin[axis] = lo;
+            quantized.exponent[axis] = static_cast<int8_t>(exponent);
+
+            for (uint32_t slot = 0; slot < used; slot++)
+            {
+                float qMin = std::min(std::max(std::floor((mins[axis][slot] - lo) / scale), 0.f), 255.f);
+                float qMax = std::min(std::max(std::ceil((maxs[axis][slot] - lo) / scale), 0.f), 255.f);
+                while (qMin > 0.f && lo + scale * qMin > mins[axis][slot])
+                    qMin--;
+                while (qMax < 255.f && lo + scale * qMax < maxs[axis][slot])
+                    qMax++;
+
+                qMins[axis][slot] = static_cast<uint8_t>(qMin);
+                qMaxs[axis][slot] = static_cast<uint8_t>(qMax);
+            }
+
+            for (uint32_t slot = used; slot < N; slot++)
+            {
+                qMins[axis][slot] = 255;
+                qMaxs[axis][slot] = 0;
+            }
+        }
+
+        for (uint32_t slot = 0; slot < N; slot++)
+        {
+            if (node.count[slot] > std::numeric_limits<uint16_t>::max())
+                throw std::runtime_error("BVH leaf has too many triangles to be compressed");
+
+            quantized.child[slot] = node.child[slot];
+            quantized.count[slot] = static_cast<uint16_t>(node.count[slot]);
+        }
+
+        return quantized;
+    }
+
+    //  Inverse of quantizeNode, the bounds are decoded with the same arithmetic as in raytracer.comp
+    template <uint32_t N>
+    inline NodeWide<N> dequantizeNode(const NodeQuantized<N> &quantized)
+    {
+        NodeWide<N> node;
+        const float inf = std::numeric_limits<float>::infinity();
+        float scale[3];
+        for (uint32_t axis = 0; axis < 3; axis++)
+            scale[axis] = std::ldexp(1.f, quantized.exponent[axis]);
+
+        for (uint32_t slot = 0; slot < N; slot++)
+        {
+            bool used = quantized.qMinX[slot] <= quantized.qMaxX[slot];
+            node.minX[slot] = used ? quantized.origin[0] + scale[0] * quantized.qMinX[slot] : inf;
+            node.minY[slot] = used ? quantized.origin[1] + scale[1] * quantized.qMinY[slot] : inf;
+            node.minZ[slot] = used ? quantized.origin[2] + scale[2] * quantized.qMinZ[slot] : inf;
+            node.maxX[slot] = used ? quantized.origin[0] + scale[0] * quantized.qMaxX[slot] : inf;
+            node.maxY[slot] = used ? quantized.origin[1] + scale[1] * quantized.qMaxY[slot] : inf;
+            node.maxZ[slot] = used ? quantized.origin[2] + scale[2] * quantized.qMaxZ[slot] : inf;
+            node.child[slot] = quantized.child[slot];
+            node.count[slot] = quantized.count[slot];
+        }
+
+        return node;
+    }
+
+    template <uint32_t N>
+    inline std::vector<NodeQuantized<N>> quantizeBVH(const std::vector<NodeWide<N>> &wide)
+    {
+        std::vector<NodeQuantized<N>> quantized(wide.size());
+        ThreadPool::global().parallelFor(0, wide.size(), 4096, [&](uint32_t nodeBegin, uint32_t nodeEnd) {
+            for (uint32_t i = nodeBegin; i < nodeEnd; i++)
+                quantized[i] = quantizeNode(wide[i]);
+        });
+
+        return quantized;
+    }
+
+    //  Octahedral normal in two snorm16, packed like packSnorm2x16
+    inline uint32_t encodeNormal(const glm::vec4 &normal)
+    {
+        float length = std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z);
+        if (length == 0.f)
+            return 0;
+
+        float x = normal.x / length;
+        float y = normal.y / length;
+        if (normal.z < 0.f)
+        {
+            float foldedX = (1.f - std::abs(y)) * (x >= 0.f ? 1.f : -1.f);
+            float foldedY = (1.f - std::abs(x)) * (y >= 0.f ? 1.f : -1.f);
+            x = foldedX;
+            y = foldedY;
+        }
+
+        auto snorm16 = [](float value) { return static_cast<uint32_t>(static_cast<uint16_t>(static_cast<int16_t>(std::round(std::min(std::max(value, -1.f), 1.f) * 32767.f)))); };
+        return snorm16(x) | (snorm16(y) << 16);
+    }
+
+    //  Matches decodeNormal in raytracer.comp
+    inline glm::vec4 decodeNormal(uint32_t encoded)
+    {
+        auto snorm16 = [](uint32_t bits) { return std::max(static_cast<float>(static_cast<int16_t>(bits & 0xffff)) / 32767.f, -1.f); };
+
+        glm::vec3 n(snorm16(encoded), snorm16(encoded >> 16), 0.f);
+        n.z = 1.f - std::abs(n.x) - std::abs(n.y);
+        float t = std::max(-n.z, 0.f);
+        n.x += n.x >= 0.f ? -t : t;
+        n.y += n.y >= 0.f ? -t : t;
+
+        return glm::vec4(glm::normalize(n), 0.f);
+    }
+
+    //  Position index of a BVH's pool, stored as glm::vec4 or as PackedPosition when compressed
+    inline glm::vec4 poolPosition(const void *positions, uint32_t index, bool compressed)
+    {
+        if (!compressed)
+            return static_cast<const glm::vec4 *>(positions)[index];
+
+        const PackedPosition &packed = static_cast<const PackedPosition *>(positions)[index];
+        return glm::vec4(packed.position[0], packed.position[1], packed.position[2], 1.f);
+    }
+
+    //  Normal index of a BVH's pool, stored as glm::vec4 or encoded by encodeNormal when compressed
+    inline glm::vec4 poolNormal(const void *normals, uint32_t index, bool compressed)
+    {
+        return compressed ? decodeNormal(static_cast<const uint32_t *>(normals)[index]) : static_cast<const glm::vec4 *>(normals)[index];
+    }
+
+    inline NodeBLAS poolTriangle(const IndexedTriangle &triangle, const void *positions, const void *normals, bool compressed)
+    {
+        return NodeBLAS{poolPosition(positions, triangle.position[0], compressed), poolPosition(positions, triangle.position[1], compressed),
+                        poolPosition(positions, triangle.position[2], compressed), poolNormal(normals, triangle.normal[0], compressed),
+                        poolNormal(normals, triangle.normal[1], compressed), poolNormal(normals, triangle.normal[2], compressed)};
+    }
+
+    //  Points the buffers at the triangles and pools of buffers.meshStorage. A compressed BVH packs the pools instead,
+    //  positions lose their w component and normals are octahedral encoded, 12 and 4 bytes instead of 16 each.
+    inline void setVertexPools(BVHBuffers &buffers, bool compress)
+    {
+        IndexedMesh &mesh = buffers.meshStorage;
+        buffers.triangles = mesh.triangles.data();
+        buffers.trianglesSize = mesh.triangles.size() * sizeof(IndexedTriangle);
+
+        if (!compress)
+        {
+            buffers.positions = mesh.positions.data();
+            buffers.positionsSize = mesh.positions.size() * sizeof(glm::vec4);
+            buffers.normals = mesh.normals.data();
+            buffers.normalsSize = mesh.normals.size() * sizeof(glm::vec4);
+            return;
+        }
+
+        buffers.packedPositionStorage.resize(mesh.positions.size());
+        buffers.packedNormalStorage.resize(mesh.normals.size());
+        ThreadPool::global().parallelFor(0, mesh.positions.size(), 4096, [&](uint32_t positionBegin, uint32_t positionEnd) {
+            for (uint32_t i = positionBegin; i < positionEnd; i++)
+                buffers.packedPositionStorage[i] = PackedPosition{{mesh.positions[i].x, mesh.positions[i].y, mesh.positions[i].z}};
+        });
+        ThreadPool::global().parallelFor(0, mesh.normals.size(), 4096, [&](uint32_t normalBegin, uint32_t normalEnd) {
+            for (uint32_t i = normalBegin; i < normalEnd; i++)
+                buffers.packedNormalStorage[i] = encodeNormal(mesh.normals[i]);
+        });
+
+        std::vector<glm::vec4>().swap(mesh.positions);
+        std::vector<glm::vec4>().swap(mesh.normals);
+        buffers.positions = buffers.packedPositionStorage.data();
+        buffers.positionsSize = buffers.packedPositionStorage.size() * sizeof(PackedPosition);
+        buffers.normals = buffers.packedNormalStorage.data();
+        buffers.normalsSize = buffers.packedNormalStorage.size() * sizeof(uint32_t);
+    }
+
+    inline size_t tlasNodeSize(uint32_t nodeWidth, bool compressed = false)
+    {
+        switch (nodeWidth)
+        {
+        case 2:
+            return sizeof(NodeTLAS);
+        case 4:
+            return compressed ? sizeof(NodeQuantized<4>) : sizeof(NodeWide<4>);
+        case 8:
+            return compressed ? sizeof(NodeQuantized<8>) : sizeof(NodeWide<8>);
+        default:
+            throw std::runtime_error("BVH nodes must have 2, 4 or 8 children");
+        }
+    }
+
+    inline uint64_t hashCombine(uint64_t hash, uint64_t value)
+    {
+        hash ^= value + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdull;
+        return hash ^ (hash >> 33);
+    }
+
+    //  64 bit hash of a byte range, computed in fixed 1 MB chunks on the pool so the result doesn't depend on the thread count
+    inline uint64_t hashBytes(ThreadPool *pool, const char *data, size_t size)
+    {
+        const size_t chunkSize = 1 << 20;
+        uint32_t chunkCount = static_cast<uint32_t>((size + chunkSize - 1) / chunkSize);
+        std::vector<uint64_t> chunkHashes(chunkCount);
+
+        auto hashChunks = [&](uint32_t chunkBegin, uint32_t chunkEnd) {
+            for (uint32_t c = chunkBegin; c < chunkEnd; c++)
+            {
+                const char *first = data + c * chunkSize;
+                size_t length = std::min(chunkSize, size - c * chunkSize);
+                uint64_t hash = 0xcbf29ce484222325ull;
+
+                size_t i = 0;
+                for (; i + 8 <= length; i += 8)
+                {
+                    uint64_t word;
+                    memcpy(&word, first + i, sizeof(word));
+                    hash = (hash ^ word) * 0x100000001b3ull;
+                    hash ^= hash >> 29;
+                }
+                for (; i < length; i++)
+                    hash = (hash ^ static_cast<unsigned char>(first[i])) * 0x100000001b3ull;
+
+                chunkHashes[c] = hash;
+            }
+        };
+
+        if (pool)
+            pool->parallelFor(0, chunkCount, 1, hashChunks);
+        else
+            hashChunks(0, chunkCount);
+
+        uint64_t hash = hashCombine(0, size);
+        for (uint64_t chunkHash : chunkHashes)
+            hash = hashCombine(hash, chunkHash);
+
+        return hash;
+    }
+
+    //  Hash of the settings that change the built tree, parallelThreshold doesn't as parallel builds match serial ones
+    inline uint64_t hashSettings(const BVHSettings &settings)
+    {
+        uint32_t traversalCost, intersectionCost;
+        memcpy(&traversalCost, &settings.traversalCost, sizeof(float));
+        memcpy(&intersectionCost, &settings.intersectionCost, sizeof(float));
+
+        uint64_t hash = 0;
+        for (uint32_t value : {static_cast<uint32_t>(settings.mode), settings.binCount, traversalCost, intersectionCost, settings.maxLeafSize, settings.mortonBits, settings.width, static_cast<uint32_t>(settings.compress), BVH_MAX_DEPTH})
+            hash = hashCombine(hash, value);
+
+        return hash;
+    }
+
+    //  Checks the children of the wide nodes come after their parent and the leaves stay within the triangles
+    template <uint32_t N, typename Node>
+    inline bool validWideNodes(const Node *wide, size_t tlasNodes, size_t triangleCount)
+    {
+        for (size_t i = 0; i < tlasNodes; i++)
+        {
+            for (uint32_t slot = 0; slot < N; slot++)
+            {
+                uint64_t child = wide[i].child[slot];
+                uint64_t count = wide[i].count[slot];
+                if (count > 0 ? child + count > triangleCount : child != 0 && (child <= i || child >= tlasNodes))
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    //  Checks a TLAS read from a file before it is traversed or refit: every child index is a later node, which also
+    //  rules out cycles, and every leaf covers existing triangles
+    inline bool validTLAS(const BVH *bvh, size_t tlasNodes, size_t triangleCount)
+    {
+        if (tlasNodes == 0)
+            return false;
+
+        if (bvh->nodeWidth == 2)
+        {
+            for (size_t i = 0; i < tlasNodes; i++)
+            {
+                uint64_t offset = nodeOffset(bvh->TLAS[i]);
+                uint64_t count = nodeCount(bvh->TLAS[i]);
+                if (count > 0 ? offset + count > triangleCount : i + 1 >= tlasNodes || offset <= i + 1 || offset >= tlasNodes)
+                    return false;
+            }
+            return true;
+        }
+        else if (bvh->nodeWidth == 4 && bvh->compressed)
+            return validWideNodes<4>(reinterpret_cast<const NodeQuantized<4> *>(bvh->TLAS), tlasNodes, triangleCount);
+        else if (bvh->nodeWidth == 4)
+            return validWideNodes<4>(reinterpret_cast<const NodeWide<4> *>(bvh->TLAS), tlasNodes, triangleCount);
+        else if (bvh->compressed)
+            return validWideNodes<8>(reinterpret_cast<const NodeQuantized<8> *>(bvh->TLAS), tlasNodes, triangleCount);
+        else
+            return validWideNodes<8>(reinterpret_cast<const NodeWide<8> *>(bvh->TLAS), tlasNodes, triangleCount);
+    }
+
+    //  Maps the cache file and checks it was written for this source and these settings
+    inline bool loadBVHCache(std::string const &cachePath, uint64_t sourceHash, uint64_t settingsHash, BVHBuffers &buffers, BVHStats &stats)
+    {
+        MappedFile file;
+        if (!file.open(cachePath, true) || file.size() < sizeof(BVHCacheHeader))
+            return false;
+
+        BVHCacheHeader header;
+        memcpy(&header, file.data(), sizeof(header));
+
+        if (memcmp(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != BVH_CACHE_VERSION ||
+            header.bvhStructSize != sizeof(BVH) || header.sourceHash != sourceHash || header.settingsHash != settingsHash)
+            return false;
+
+        const uint64_t offsets[4] = {header.bvhOffset, header.trianglesOffset, header.positionsOffset, header.normalsOffset};
+        const uint64_t sizes[4] = {header.bvhSize, header.trianglesSize, header.positionsSize, header.normalsSize};
+        for (uint32_t i = 0; i < 4; i++)
+        {
+            if (offsets[i] % 16 != 0 || offsets[i] > file.size() || sizes[i] > file.size() - offsets[i])
+                return false;
+        }
+
+        //  The BVH header has to be there before its width and compression are read
+        if (header.bvhSize < offsetof(BVH, TLAS))
+            return false;
+
+        //  The settings hash covers the width and compression, the struct sizes catch layout changes of the nodes
+        const BVH *bvh = reinterpret_cast<const BVH *>(file.data() + header.bvhOffset);
+        bool compressed = bvh->compressed != 0;
+        if ((bvh->nodeWidth != 2 && bvh->nodeWidth != 4 && bvh->nodeWidth != 8) || (compressed && bvh->nodeWidth == 2) ||
+            header.tlasNodeSize != tlasNodeSize(bvh->nodeWidth, compressed) || (header.bvhSize - offsetof(BVH, TLAS)) % header.tlasNodeSize != 0 ||
+            header.triangleStructSize != sizeof(IndexedTriangle) || header.trianglesSize % sizeof(IndexedTriangle) != 0 ||
+            header.positionsSize % (compressed ? sizeof(PackedPosition) : sizeof(glm::vec4)) != 0 ||
+            header.normalsSize % (compressed ? sizeof(uint32_t) : sizeof(glm::vec4)) != 0)
+            return false;
+
+        //  A corrupted file must not send the traversal or the refit outside the buffers
+        size_t triangleCount = header.trianglesSize / sizeof(IndexedTriangle);
+        if (!validTLAS(bvh, (header.bvhSize - offsetof(BVH, TLAS)) / header.tlasNodeSize, triangleCount))
+            return false;
+
+        const IndexedTriangle *triangles = reinterpret_cast<const IndexedTriangle *>(file.data() + header.trianglesOffset);
+        uint64_t positionCount = header.positionsSize / (compressed ? sizeof(PackedPosition) : sizeof(glm::vec4));
+        uint64_t normalCount = header.normalsSize / (compressed ? sizeof(uint32_t) : sizeof(glm::vec4));
+        for (size_t i = 0; i < triangleCount; i++)
+        {
+            for (uint32_t corner = 0; corner < 3; corner++)
+            {
+                if (triangles[i].position[corner] >= positionCount || triangles[i].normal[corner] >= normalCount)
+                    return false;
+            }
+        }
+
+        buffers.bvh = reinterpret_cast<BVH *>(file.data() + header.bvhOffset);
+        buffers.bvhSize = header.bvhSize;
+        buffers.triangles = reinterpret_cast<IndexedTriangle *>(file.data() + header.trianglesOffset);
+        buffers.trianglesSize = header.trianglesSize;
+        buffers.positions = file.data() + header.positionsOffset;
+        buffers.positionsSize = header.positionsSize;
+        buffers.normals = file.data() + header.normalsOffset;
+        buffers.normalsSize = header.normalsSize;
+        buffers.triangleCount = triangleCount;
+        buffers.cacheFile = std::move(file);
+        stats = header.stats;
+
+        return true;
+    }
+
+    //  Path of the cache for these settings, the hash goes in front of the extension: armadillo.<settings>.bvhcache
+    inline std::string bvhCachePath(std::string const &cachePath, uint64_t settingsHash)
+    {
+        std::ostringstream settings;
+        settings << std::hex << settingsHash;
+
+        size_t extension = cachePath.find_last_of('.');
+        size_t directory = cachePath.find_last_of("/\\");
+        if (extension == std::string::npos || (directory != std::string::npos && extension < directory))
+            return cachePath + "." + settings.str();
+
+        return cachePath.substr(0, extension) + "." + settings.str() + cachePath.substr(extension);
+    }
+
+    //  Writes the cache to a temporary file next to it and renames it over cachePath. Other processes may have the old
+    //  file mapped, they keep reading it while the new one takes its name.
+    inline bool writeBVHCache(std::string const &cachePath, uint64_t sourceHash, uint64_t settingsHash, const BVHBuffers &buffers, const BVHStats &stats)
+    {
+        auto alignOffset = [](uint64_t offset) { return (offset + 15) & ~uint64_t(15); };
+
+        BVHCacheHeader header{};
+        memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+        header.version = BVH_CACHE_VERSION;
+        header.bvhStructSize = sizeof(BVH);
+        header.tlasNodeSize = tlasNodeSize(buffers.bvh->nodeWidth, buffers.bvh->compressed != 0);
+        header.triangleStructSize = sizeof(IndexedTriangle);
+        header.sourceHash = sourceHash;
+        header.settingsHash = settingsHash;
+        header.bvhOffset = alignOffset(sizeof(header));
+        header.bvhSize = buffers.bvhSize;
+        header.trianglesOffset = alignOffset(header.bvhOffset + header.bvhSize);
+        header.trianglesSize = buffers.trianglesSize;
+        header.positionsOffset = alignOffset(header.trianglesOffset + header.trianglesSize);
+        header.positionsSize = buffers.positionsSize;
+        header.normalsOffset = alignOffset(header.positionsOffset + header.positionsSize);
+        header.normalsSize = buffers.normalsSize;
+        header.stats = stats;
+
+        std::ostringstream suffix;
+        suffix << ".tmp" << std::hex << std::random_device()() << std::chrono::steady_clock::now().time_since_epoch().count();
+        std::string tempPath = cachePath + suffix.str();
+
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        if (!file)
+            return false;
+
+        const char padding[16] = {};
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(padding, header.bvhOffset - sizeof(header));
+        file.write(reinterpret_cast<const char *>(buffers.bvh), buffers.bvhSize);
+        file.write(padding, header.trianglesOffset - header.bvhOffset - header.bvhSize);
+        file.write(reinterpret_cast<const char *>(buffers.triangles), header.trianglesSize);
+        file.write(padding, header.positionsOffset - header.trianglesOffset - header.trianglesSize);
+        file.write(static_cast<const char *>(buffers.positions), header.positionsSize);
+        file.write(padding, header.normalsOffset - header.positionsOffset - header.positionsSize);
+        file.write(static_cast<const char *>(buffers.normals), header.normalsSize);
+        file.close();
+
+        if (!file)
+        {
+            std::remove(tempPath.c_str());
+            return false;
+        }
+
+        //  Windows doesn't rename over an existing file
+        if (std::rename(tempPath.c_str(), cachePath.c_str()) != 0)
+        {
+            std::remove(cachePath.c_str());
+            if (std::rename(tempPath.c_str(), cachePath.c_str()) != 0)
+            {
+                std::remove(tempPath.c_str());
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    inline void printBVHStats(std::string const &path, const BVHSettings &settings, size_t triangleCount, const BVHStats &stats, const char *source, double milliseconds)
+    {
+        const char *modeNames[] = {"median", "SAH", "LBVH"};
+        std::cout << "BVH " << path << " (" << modeNames[static_cast<int>(settings.mode)] << "): "
+                  << triangleCount << " triangles, " << stats.interiorNodes << " interior nodes, "
+                  << stats.leafNodes << " leaves, depth " << stats.maxDepth << ", SAH cost " << stats.sahCost;
+        if (settings.width > 2)
+            std::cout << ", " << stats.wideNodes << (settings.compress ? " compressed " : " ") << settings.width << "-wide nodes, depth " << stats.wideDepth;
+        std::cout << ", " << source << " in " << milliseconds << " ms" << std::endl;
+    }
+
+    //  Builds the TLAS over buffers.meshStorage, collapses it to settings.width children per node, compresses it if
+    //  asked and lays out the BVH header and TLAS in buffers.bvhStorage. The triangles are reordered so every leaf
+    //  covers a contiguous range of them, the pools stay as they are.
+    inline void buildBVHBuffers(BVHBuffers &buffers, Material &material, glm::mat4 &transform, const BVHSettings &settings, BVHStats &stats)
+    {
+        if (settings.compress && settings.width == 2)
+            throw std::runtime_error("compressed BVHs need 4 or 8 children per node");
+
+        size_t nodeSize = tlasNodeSize(settings.width, settings.compress);
+        std::vector<NodeTLAS> primitives = primitiveBounds(buffers.meshStorage);
+        std::vector<NodeTLAS> tlas = buildTLAS(primitives, settings, stats);
+        std::vector<NodeWide<4>> tlas4;
+        std::vector<NodeWide<8>> tlas8;
+        std::vector<NodeQuantized<4>> quantized4;
+        std::vector<NodeQuantized<8>> quantized8;
+
+        const void *tlasData = tlas.data();
+        size_t tlasSizeParams = tlas.size() * nodeSize;
+        if (settings.width == 4)
+        {
+            tlas4 = collapseBVH<4>(tlas, stats);
+            tlasData = tlas4.data();
+            tlasSizeParams = tlas4.size() * nodeSize;
+            if (settings.compress)
+            {
+                quantized4 = quantizeBVH(tlas4);
+                tlasData = quantized4.data();
+            }
+        }
+        else if (settings.width == 8)
+        {
+            tlas8 = collapseBVH<8>(tlas, stats);
+            tlasData = tlas8.data();
+            tlasSizeParams = tlas8.size() * nodeSize;
+            if (settings.compress)
+            {
+                quantized8 = quantizeBVH(tlas8);
+                tlasData = quantized8.data();
+            }
+        }
+
+        buffers.bvhSize = offsetof(BVH, TLAS) + tlasSizeParams;
+        buffers.bvhStorage.resize(std::max(buffers.bvhSize, sizeof(BVH)));
+        buffers.bvh = reinterpret_cast<BVH *>(buffers.bvhStorage.data());
+        buffers.bvh->inverseTransform = glm::affineInverse(transform);
+        buffers.bvh->material = material;
+        buffers.bvh->nodeWidth = settings.width;
+        buffers.bvh->compressed = settings.compress ? 1 : 0;
+        memcpy(buffers.bvh->TLAS, tlasData, tlasSizeParams);
+
+        std::vector<IndexedTriangle> &triangles = buffers.meshStorage.triangles;
+        std::vector<IndexedTriangle> ordered(triangles.size());
+        ThreadPool::global().parallelFor(0, ordered.size(), 4096, [&](uint32_t triangleBegin, uint32_t triangleEnd) {
+            for (uint32_t i = triangleBegin; i < triangleEnd; i++)
+                ordered[i] = triangles[nodeOffset(primitives[i])];
+        });
+        triangles.swap(ordered);
+
+        buffers.triangleCount = triangles.size();
+        setVertexPools(buffers, settings.compress);
+    }
+
+    //  Builds the BVH of triangles generated in memory, e.g. by makeBenchmarkTriangles
+    inline BVHBuffers makeBVH(IndexedMesh mesh, std::string const &name, Material &material, glm::mat4 &transform, const BVHSettings &settings = BVHSettings())
+    {
+        BVHBuffers buffers;
+        BVHStats stats;
+
+        auto buildStart = std::chrono::steady_clock::now();
+
+        buffers.meshStorage = std::move(mesh);
+        buildBVHBuffers(buffers, material, transform, settings, stats);
+
+        auto buildTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart);
+        printBVHStats(name, settings, buffers.triangleCount, stats, "built", buildTime.count());
+
+        return buffers;
+    }
+
+    //  Builds the BVH of the OBJ file at path. With a cachePath the BVH is loaded from the cache file when it matches the
+    //  contents of the OBJ file and the settings, otherwise it's built and written to the cache for the next run. Every
+    //  set of settings has its own cache file, see bvhCachePath.
+    inline BVHBuffers makeBVH(std::string const &path, Material &material, glm::mat4 &transform, const BVHSettings &settings = BVHSettings(), std::string const &cachePath = "")
+    {
+        BVHBuffers buffers;
+        BVHStats stats;
+        uint64_t sourceHash = 0;
+        uint64_t settingsHash = hashSettings(settings);
+        std::string settingsCachePath = cachePath.empty() ? cachePath : bvhCachePath(cachePath, settingsHash);
+
+        auto buildStart = std::chrono::steady_clock::now();
+
+        if (!cachePath.empty())
+        {
+            MappedFile source;
+            if (source.open(path))
+                sourceHash = hashBytes(&ThreadPool::global(), source.data(), source.size());
+
+            if (source.isOpen() && loadBVHCache(settingsCachePath, sourceHash, settingsHash, buffers, stats))
+            {
+                //  The mapping is copy-on-write, only the page holding the header gets copied
+                buffers.bvh->inverseTransform = glm::affineInverse(transform);
+                buffers.bvh->material = material;
+
+                auto loadTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart);
+                printBVHStats(path, settings, buffers.triangleCount, stats, "loaded from cache", loadTime.count());
+
+                return buffers;
+            }
+        }
+
+        buffers.meshStorage = parseObjFile(path);
+        buildBVHBuffers(buffers, material, transform, settings, stats);
+
+        auto buildTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart);
+        printBVHStats(path, settings, buffers.triangleCount, stats, "built", buildTime.count());
+
+        if (!cachePath.empty() && sourceHash != 0 && !writeBVHCache(settingsCachePath, sourceHash, settingsHash, buffers, stats))
+            std::cout << "Impossible to write the BVH cache: " << settingsCachePath << std::endl;
+
+        return buffers;
+    }
+
+    inline size_t tlasNodeCount(const BVHBuffers &buffers)
+    {
+        return (buffers.bvhSize - offsetof(BVH, TLAS)) / tlasNodeSize(buffers.bvh->nodeWidth, buffers.bvh->compressed != 0);
+    }
+
+    inline size_t poolPositionCount(const BVHBuffers &buffers)
+    {
+        return buffers.positionsSize / (buffers.bvh->compressed ? sizeof(PackedPosition) : sizeof(glm::vec4));
+    }
+
+    inline std::vector<glm::vec4> readPoolPositions(const BVHBuffers &buffers)
+    {
+        std::vector<glm::vec4> positions(poolPositionCount(buffers));
+        for (size_t i = 0; i < positions.size(); i++)
+            positions[i] = poolPosition(buffers.positions, i, buffers.bvh->compressed != 0);
+
+        return positions;
+    }
+
+    //  Replaces the positions of the pool, in the same order. The triangles and the normals stay as they are, so the
+    //  mesh keeps its topology and only its vertices move. The TLAS is out of date until refitBVH.
+    inline void writePoolPositions(BVHBuffers &buffers, const std::vector<glm::vec4> &positions)
+    {
+        if (positions.size() != poolPositionCount(buffers))
+            throw std::runtime_error("refit positions don't match the position pool of the BVH");
+
+        if (!buffers.bvh->compressed)
+        {
+            memcpy(buffers.positions, positions.data(), buffers.positionsSize);
+            return;
+        }
+
+        PackedPosition *packed = static_cast<PackedPosition *>(buffers.positions);
+        ThreadPool::global().parallelFor(0, positions.size(), 4096, [&](uint32_t positionBegin, uint32_t positionEnd) {
+            for (uint32_t i = positionBegin; i < positionEnd; i++)
+                packed[i] = PackedPosition{{positions[i].x, positions[i].y, positions[i].z}};
+        });
+    }
+
+    //  Order in which refitBVH updates the TLAS nodes: the node indices grouped by depth, deepest level first, level i
+    //  is nodes[levels[i]] to nodes[levels[i + 1]]. A node only depends on its children, which are all in earlier
+    //  levels, so the nodes of a level are refit in parallel. The refit pass of refit.comp runs one dispatch per level.
+    struct RefitSchedule
+    {
+        std::vector<uint32_t> nodes;
+        std::vector<uint32_t> levels;
+    };
+
+    template <uint32_t N, typename Node>
+    inline void wideNodeDepths(const Node *wide, std::vector<uint32_t> &depths)
+    {
+        for (size_t i = 0; i < depths.size(); i++)
+        {
+            for (uint32_t slot = 0; slot < N; slot++)
+            {
+                if (wide[i].count[slot] == 0 && wide[i].child[slot] != 0)
+                    depths[wide[i].child[slot]] = depths[i] + 1;
+            }
+        }
+    }
+
+    inline RefitSchedule makeRefitSchedule(const BVHBuffers &buffers)
+    {
+        const BVH *bvh = buffers.bvh;
+        std::vector<uint32_t> depths(tlasNodeCount(buffers), 0);
+
+        //  Parents are stored before their children in every layout, so one pass in index order finds all depths
+        if (bvh->nodeWidth == 2)
+        {
+            for (size_t i = 0; i < depths.size(); i++)
+            {
+                if (nodeCount(bvh->TLAS[i]) == 0)
+                    depths[i + 1] = depths[nodeOffset(bvh->TLAS[i])] = depths[i] + 1;
+            }
+        }
+        else if (bvh->nodeWidth == 4 && bvh->compressed)
+            wideNodeDepths<4>(reinterpret_cast<const NodeQuantized<4> *>(bvh->TLAS), depths);
+        else if (bvh->nodeWidth == 4)
+            wideNodeDepths<4>(reinterpret_cast<const NodeWide<4> *>(bvh->TLAS), depths);
+        else if (bvh->compressed)
+            wideNodeDepths<8>(reinterpret_cast<const NodeQuantized<8> *>(bvh->TLAS), depths);
+        else
+            wideNodeDepths<8>(reinterpret_cast<const NodeWide<8> *>(bvh->TLAS), depths);
+
+        //  Counting sort by depth, the deepest level goes first
+        RefitSchedule schedule;
+        uint32_t levelCount = depths.empty() ? 0 : *std::max_element(depths.begin(), depths.end()) + 1;
+        schedule.levels.assign(levelCount + 1, 0);
+        for (uint32_t depth : depths)
+            schedule.levels[levelCount - depth]++;
+        for (uint32_t level = 0; level < levelCount; level++)
+            schedule.levels[level + 1] += schedule.levels[level];
+
+        std::vector<uint32_t> next(schedule.levels.begin(), schedule.levels.end() - 1);
+        schedule.nodes.resize(depths.size());
+        for (size_t i = 0; i < depths.size(); i++)
+            schedule.nodes[next[levelCount - 1 - depths[i]]++] = i;
+
+        return schedule;
+    }
+
+    //  Union of the triangle boxes of a leaf, the same as the builders compute
+    inline NodeTLAS leafBounds(const BVHBuffers &buffers, uint32_t first, uint32_t count)
+    {
+        bool compressed = buffers.bvh->compressed != 0;
+        NodeTLAS bounds = emptyBoundsUnion();
+        for (uint32_t i = first; i < first + count; i++)
+        {
+            const IndexedTriangle &triangle = buffers.triangles[i];
+            bounds = mergeBounds(bounds, triangleBounds(poolPosition(buffers.positions, triangle.position[0], compressed),
+                                                        poolPosition(buffers.positions, triangle.position[1], compressed),
+                                                        poolPosition(buffers.positions, triangle.position[2], compressed)));
+        }
+
+        return bounds;
+    }
+
+    //  Sets the boxes of the used slots from the triangles of leaf children and the exact bounds of interior ones,
+    //  returns the union of the slots
+    template <uint32_t N>
+    inline NodeTLAS refitWideNode(const BVHBuffers &buffers, NodeWide<N> &node, const std::vector<NodeTLAS> &bounds)
+    {
+        NodeTLAS nodeBounds = emptyBoundsUnion();
+        for (uint32_t slot = 0; slot < N; slot++)
+        {
+            if (node.count[slot] == 0 && node.child[slot] == 0)
+                continue;
+
+            NodeTLAS childBounds = node.count[slot] > 0 ? leafBounds(buffers, node.child[slot], node.count[slot]) : bounds[node.child[slot]];
+            setWideChild(node, slot, childBounds, node.child[slot], node.count[slot]);
+            nodeBounds = mergeBounds(nodeBounds, childBounds);
+        }
+
+        return nodeBounds;
+    }
+
+    template <typename Refit>
+    inline void refitLevels(const RefitSchedule &schedule, Refit refit)
+    {
+        for (size_t level = 0; level + 1 < schedule.levels.size(); level++)
+        {
+            ThreadPool::global().parallelFor(schedule.levels[level], schedule.levels[level + 1], 1024, [&](uint32_t nodeBegin, uint32_t nodeEnd) {
+                for (uint32_t i = nodeBegin; i < nodeEnd; i++)
+                    refit(schedule.nodes[i]);
+            });
+        }
+    }
+
+    template <uint32_t N>
+    inline void refitWideBVH(BVHBuffers &buffers, const RefitSchedule &schedule, std::vector<NodeTLAS> &bounds)
+    {
+        if (buffers.bvh->compressed)
+        {
+            //  The quantized boxes are looser than the exact ones, parents are quantized from the exact bounds of their children
+            NodeQuantized<N> *quantized = reinterpret_cast<NodeQuantized<N> *>(buffers.bvh->TLAS);
+            refitLevels(schedule, [&](uint32_t i) {
+                NodeWide<N> node = dequantizeNode(quantized[i]);
+                bounds[i] = refitWideNode(buffers, node, bounds);
+                quantized[i] = quantizeNode(node);
+            });
+            return;
+        }
+
+        NodeWide<N> *wide = reinterpret_cast<NodeWide<N> *>(buffers.bvh->TLAS);
+        refitLevels(schedule, [&](uint32_t i) { bounds[i] = refitWideNode(buffers, wide[i], bounds); });
+    }
+
+    //  Recomputes the boxes of the TLAS bottom-up from the current positions of the pool, keeping the tree as it is.
+    //  Much faster than a rebuild, but the SAH cost grows as the vertices move away from where the tree was built.
+    inline void refitBVH(BVHBuffers &buffers, const RefitSchedule &schedule)
+    {
+        std::vector<NodeTLAS> bounds(tlasNodeCount(buffers));
+
+        if (buffers.bvh->nodeWidth == 4)
+        {
+            refitWideBVH<4>(buffers, schedule, bounds);
+        }
+        else if (buffers.bvh->nodeWidth == 8)
+        {
+            refitWideBVH<8>(buffers, schedule, bounds);
+        }
+        else
+        {
+            //  Only the xyz components change, w holds the child and triangle offsets
+            NodeTLAS *tlas = buffers.bvh->TLAS;
+            refitLevels(schedule, [&](uint32_t i) {
+                NodeTLAS &node = tlas[i];
+                bounds[i] = nodeCount(node) > 0 ? leafBounds(buffers, nodeOffset(node), nodeCount(node)) : mergeBounds(bounds[i + 1], bounds[nodeOffset(node)]);
+                node.first.x = bounds[i].first.x;
+                node.first.y = bounds[i].first.y;
+                node.first.z = bounds[i].first.z;
+                node.second.x = bounds[i].second.x;
+                node.second.y = bounds[i].second.y;
+                node.second.z = bounds[i].second.z;
+            });
+        }
+    }
+
+    //  Moves the vertices of the BVH to positions and refits it, for a single update. Meshes animated over many frames
+    //  keep the RefitSchedule and call writePoolPositions and refitBVH(buffers, schedule).
+    inline void refitBVH(BVHBuffers &buffers, const std::vector<glm::vec4> &positions)
+    {
+        writePoolPositions(buffers, positions);
+        refitBVH(buffers, makeRefitSchedule(buffers));
     }
 
 } // namespace Primitives
@@ -0,0 +1,186 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+namespace
+{
+    thread_local const ThreadPool *workerPool = nullptr;
+    thread_local uint32_t workerIndex = 0;
+} // namespace
+
+ThreadPool::TaskGroup::TaskGroup() : pending(0)
+{
+}
+
+ThreadPool::ThreadPool(uint32_t workerCount) : queuedTasks(0)
+{
+    for (uint32_t i = 0; i < workerCount + 1; i++)
+    {
+        queues.push_back(std::make_unique<Queue>());
+    }
+
+    workers.reserve(workerCount);
+    for (uint32_t i = 0; i < workerCount; i++)
+    {
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    wakeCondition.notify_all();
+
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+}
+
+ThreadPool &ThreadPool::global()
+{
+    static ThreadPool pool(std::max(std::thread::hardware_concurrency(), 1u) - 1);
+    return pool;
+}
+
+uint32_t ThreadPool::getThreadCount() const
+{
+    return static_cast<uint32_t>(workers.size()) + 1;
+}
+
+uint32_t ThreadPool::currentQueue() const
+{
+    return workerPool == this ? workerIndex : static_cast<uint32_t>(queues.size()) - 1;
+}
+
+void ThreadPool::spawn(TaskGroup &group, std::function<void()> task)
+{
+    group.pending.fetch_add(1);
+
+    Queue &queue = *queues[currentQueue()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(Task{std::move(task), &group});
+    }
+    queuedTasks.fetch_add(1);
+
+    // Taking the lock orders the notification after a worker that is about to sleep checked queuedTasks
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+    }
+    wakeCondition.notify_one();
+}
+
+bool ThreadPool::popTask(uint32_t index, Task &task)
+{
+    {
+        Queue &own = *queues[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+
+    for (size_t i = 1; i < queues.size(); i++)
+    {
+        Queue &victim = *queues[(index + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool ThreadPool::tryRunTask(uint32_t index)
+{
+    Task task;
+    if (!popTask(index, task))
+    {
+        return false;
+    }
+    queuedTasks.fetch_sub(1);
+
+    try
+    {
+        task.function();
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> lock(task.group->errorMutex);
+        if (!task.group->error)
+        {
+            task.group->error = std::current_exception();
+        }
+    }
+
+    task.group->pending.fetch_sub(1);
+    return true;
+}
+
+void ThreadPool::workerLoop(uint32_t index)
+{
+    workerPool = this;
+    workerIndex = index;
+
+    while (true)
+    {
+        if (tryRunTask(index))
+        {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wakeCondition.wait(lock, [this] { return stopping || queuedTasks.load() > 0; });
+
+        if (stopping && queuedTasks.load() == 0)
+        {
+            return;
+        }
+    }
+}
+
+void ThreadPool::wait(TaskGroup &group)
+{
+    uint32_t index = currentQueue();
+
+    while (group.pending.load() > 0)
+    {
+        if (!tryRunTask(index))
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    if (group.error)
+    {
+        std::exception_ptr error = group.error;
+        group.error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+void ThreadPool::parallelFor(uint32_t begin, uint32_t end, uint32_t grainSize, const std::function<void(uint32_t, uint32_t)> &body)
+{
+    grainSize = std::max(grainSize, 1u);
+
+    TaskGroup group;
+    for (uint32_t chunkBegin = begin; chunkBegin < end;)
+    {
+        uint32_t chunkEnd = chunkBegin + std::min(grainSize, end - chunkBegin);
+        spawn(group, [&body, chunkBegin, chunkEnd]() { body(chunkBegin, chunkEnd); });
+        chunkBegin = chunkEnd;
+    }
+
+    wait(group);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//  Work-stealing pool for fork-join style parallelism. Every worker owns a deque: it pushes and pops
+//  its own tasks at the back and steals from the front of the others. A thread waiting on a TaskGroup
+//  keeps running queued tasks, so tasks can spawn and wait on nested groups without deadlocking.
+class ThreadPool
+{
+public:
+    class TaskGroup
+    {
+    public:
+        TaskGroup();
+
+    private:
+        friend class ThreadPool;
+
+        std::atomic<uint32_t> pending;
+        std::mutex errorMutex;
+        std::exception_ptr error;
+    };
+
+    explicit ThreadPool(uint32_t workerCount);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    //  Shared pool with one worker per hardware thread besides the caller
+    static ThreadPool &global();
+
+    //  Number of threads working on tasks, including the one waiting
+    uint32_t getThreadCount() const;
+
+    void spawn(TaskGroup &group, std::function<void()> task);
+
+    //  Runs queued tasks until every task of the group finished, then rethrows the first exception thrown by one of them
+    void wait(TaskGroup &group);
+
+    //  Calls body(chunkBegin, chunkEnd) for the chunks begin + k * grainSize of [begin, end) and waits for all of them
+    void parallelFor(uint32_t begin, uint32_t end, uint32_t grainSize, const std::function<void(uint32_t, uint32_t)> &body);
+
+private:
+    struct Task
+    {
+        std::function<void()> function;
+        TaskGroup *group;
+    };
+
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    //  One queue per worker, the last one is shared by threads from outside the pool
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex sleepMutex;
+    std::condition_variable wakeCondition;
+    std::atomic<uint32_t> queuedTasks;
+    bool stopping = false;
+
+    void workerLoop(uint32_t index);
+    bool tryRunTask(uint32_t index);
+    bool popTask(uint32_t index, Task &task);
+    uint32_t currentQueue() const;
+};
@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <iostream>
+#include <cstring>
 
 extern const bool enableValidationLayers;
 extern const std::vector<const char*> validationLayers;
@@ -0,0 +1,205 @@
+#include "VulkanAllocator.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+VulkanAllocator::VulkanAllocator(VkDevice& device, VkPhysicalDevice& physicalDevice) : device(device), physicalDevice(physicalDevice) {
+}
+
+VulkanAllocator::~VulkanAllocator() {
+}
+
+void VulkanAllocator::init(VkDeviceSize size) {
+    blockSize = size;
+
+    // Queried once, these never change for a device
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    nonCoherentAtomSize = std::max<VkDeviceSize>(properties.limits.nonCoherentAtomSize, 1);
+    maxAllocationCount = properties.limits.maxMemoryAllocationCount;
+}
+
+void VulkanAllocator::destroy() {
+    for (auto& block : blocks) {
+        if (block->mapped) {
+            vkUnmapMemory(device, block->memory);
+        }
+        vkFreeMemory(device, block->memory, nullptr);
+    }
+
+    blocks.clear();
+    stats = Stats();
+}
+
+uint32_t VulkanAllocator::findMemoryType(uint32_t typeBits, VkMemoryPropertyFlags memoryPropertyFlags) const {
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+        if ((typeBits & (1u << i)) && (memoryProperties.memoryTypes[i].propertyFlags & memoryPropertyFlags) == memoryPropertyFlags) {
+            return i;
+        }
+    }
+
+    throw std::runtime_error("failed to find suitable memory type!");
+}
+
+const VkPhysicalDeviceMemoryProperties& VulkanAllocator::getMemoryProperties() const {
+    return memoryProperties;
+}
+
+VulkanAllocator::Stats VulkanAllocator::getStats() const {
+    return stats;
+}
+
+VulkanAllocation VulkanAllocator::allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags memoryPropertyFlags, bool linear) {
+    uint32_t memoryType = findMemoryType(requirements.memoryTypeBits, memoryPropertyFlags);
+    VkMemoryPropertyFlags typeFlags = memoryProperties.memoryTypes[memoryType].propertyFlags;
+
+    // Flushes and invalidates of non coherent memory work on whole atoms, so allocations must not share one
+    bool hostCoherent = !(typeFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) || (typeFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    VkDeviceSize alignment = std::max<VkDeviceSize>(requirements.alignment, 1);
+    VkDeviceSize size = requirements.size;
+    if (!hostCoherent) {
+        alignment = alignUp(alignment, nonCoherentAtomSize);
+        size = alignUp(size, nonCoherentAtomSize);
+    }
+
+    Block* target = nullptr;
+    VkDeviceSize offset = 0;
+
+    if (size <= blockSize / 2) {
+        for (auto& block : blocks) {
+            if (block->memoryType == memoryType && block->linear == linear && block->size == blockSize && allocateFromBlock(*block, size, alignment, offset)) {
+                target = block.get();
+                break;
+            }
+        }
+    }
+
+    if (!target) {
+        target = &createBlock(size <= blockSize / 2 ? blockSize : size, memoryType, linear);
+        allocateFromBlock(*target, size, alignment, offset);
+    }
+
+    target->allocationCount++;
+    stats.allocationCount++;
+    stats.usedBytes += size;
+
+    VulkanAllocation allocation;
+    allocation.memory = target->memory;
+    allocation.offset = offset;
+    allocation.size = size;
+    allocation.mapped = target->mapped ? static_cast<char*>(target->mapped) + offset : nullptr;
+    allocation.memoryType = memoryType;
+    allocation.hostCoherent = hostCoherent;
+    return allocation;
+}
+
+void VulkanAllocator::free(const VulkanAllocation& allocation) {
+    auto block = std::find_if(blocks.begin(), blocks.end(), [&allocation](const std::unique_ptr<Block>& block) { return block->memory == allocation.memory; });
+    if (block == blocks.end()) {
+        return;
+    }
+
+    stats.allocationCount--;
+    stats.usedBytes -= allocation.size;
+
+    if (--(*block)->allocationCount == 0) {
+        if ((*block)->mapped) {
+            vkUnmapMemory(device, (*block)->memory);
+        }
+        vkFreeMemory(device, (*block)->memory, nullptr);
+
+        stats.blockCount--;
+        stats.reservedBytes -= (*block)->size;
+        blocks.erase(block);
+        return;
+    }
+
+    // Give the range back, merged with the free ranges right before and after it
+    auto& freeRanges = (*block)->freeRanges;
+    VkDeviceSize offset = allocation.offset;
+    VkDeviceSize size = allocation.size;
+
+    auto next = freeRanges.lower_bound(offset);
+    if (next != freeRanges.begin()) {
+        auto previous = std::prev(next);
+        if (previous->first + previous->second == offset) {
+            offset = previous->first;
+            size += previous->second;
+            freeRanges.erase(previous);
+        }
+    }
+    if (next != freeRanges.end() && offset + size == next->first) {
+        size += next->second;
+        freeRanges.erase(next);
+    }
+
+    freeRanges[offset] = size;
+}
+
+bool VulkanAllocator::allocateFromBlock(Block& block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset) {
+    // First fit, the padding in front of an aligned allocation stays free
+    for (auto range = block.freeRanges.begin(); range != block.freeRanges.end(); ++range) {
+        VkDeviceSize rangeStart = range->first;
+        VkDeviceSize rangeEnd = range->first + range->second;
+        VkDeviceSize start = alignUp(rangeStart, alignment);
+
+        if (start + size > rangeEnd) {
+            continue;
+        }
+
+        block.freeRanges.erase(range);
+        if (start > rangeStart) {
+            block.freeRanges[rangeStart] = start - rangeStart;
+        }
+        if (start + size < rangeEnd) {
+            block.freeRanges[start + size] = rangeEnd - start - size;
+        }
+
+        offset = start;
+        return true;
+    }
+
+    return false;
+}
+
+VulkanAllocator::Block& VulkanAllocator::createBlock(VkDeviceSize size, uint32_t memoryType, bool linear) {
+    if (maxAllocationCount && stats.blockCount >= maxAllocationCount) {
+        throw std::runtime_error("exceeded the device's limit of " + std::to_string(maxAllocationCount) + " memory allocations!");
+    }
+
+    auto block = std::make_unique<Block>();
+    block->size = size;
+    block->memoryType = memoryType;
+    block->linear = linear;
+    block->freeRanges[0] = size;
+
+    VkMemoryAllocateInfo memAlloc{};
+    memAlloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memAlloc.allocationSize = size;
+    memAlloc.memoryTypeIndex = memoryType;
+
+    if (vkAllocateMemory(device, &memAlloc, nullptr, &block->memory) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate buffer memory!");
+    }
+
+    // Memory can only be mapped once, host visible blocks are mapped for their whole lifetime
+    if (memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        if (vkMapMemory(device, block->memory, 0, VK_WHOLE_SIZE, 0, &block->mapped) != VK_SUCCESS) {
+            vkFreeMemory(device, block->memory, nullptr);
+            throw std::runtime_error("failed to map buffer memory!");
+        }
+    }
+
+    stats.blockCount++;
+    stats.reservedBytes += size;
+
+    blocks.push_back(std::move(block));
+    return *blocks.back();
+}
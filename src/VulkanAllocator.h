@@ -0,0 +1,74 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <map>
+#include <memory>
+#include <vector>
+
+//  Part of a memory block handed out to one resource. Blocks in host visible memory stay mapped, mapped
+//  then points at the start of the allocation.
+struct VulkanAllocation {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    void* mapped = nullptr;
+    uint32_t memoryType = 0;
+    bool hostCoherent = true;
+};
+
+//  Sub-allocates resources out of large VkDeviceMemory blocks, one list of blocks per memory type, since
+//  drivers cap the number of allocations and each one is slow. Linear resources (buffers) and optimal
+//  tiling images never share a block, which keeps them bufferImageGranularity apart. Resources larger than
+//  half a block get a block of their own, and blocks are freed as soon as they are empty.
+class VulkanAllocator {
+public:
+    static const VkDeviceSize DEFAULT_BLOCK_SIZE = 64 * 1024 * 1024;
+
+    struct Stats {
+        uint32_t blockCount = 0;
+        uint32_t allocationCount = 0;
+        VkDeviceSize reservedBytes = 0;
+        VkDeviceSize usedBytes = 0;
+    };
+
+    VulkanAllocator(VkDevice& parentDevice, VkPhysicalDevice& parentPhysicalDevice);
+    ~VulkanAllocator();
+
+    void init(VkDeviceSize blockSize = DEFAULT_BLOCK_SIZE);
+    void destroy();
+
+    VulkanAllocation allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags memoryPropertyFlags, bool linear = true);
+    void free(const VulkanAllocation& allocation);
+
+    //  First memory type allowed by typeBits that has all the properties, throws if there is none
+    uint32_t findMemoryType(uint32_t typeBits, VkMemoryPropertyFlags memoryPropertyFlags) const;
+    const VkPhysicalDeviceMemoryProperties& getMemoryProperties() const;
+
+    Stats getStats() const;
+
+private:
+    struct Block {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkDeviceSize size = 0;
+        void* mapped = nullptr;
+        uint32_t memoryType = 0;
+        bool linear = true;
+        uint32_t allocationCount = 0;
+        //  Free ranges by offset, neighbours are merged on free
+        std::map<VkDeviceSize, VkDeviceSize> freeRanges;
+    };
+
+    VkDevice& device;
+    VkPhysicalDevice& physicalDevice;
+
+    VkPhysicalDeviceMemoryProperties memoryProperties{};
+    VkDeviceSize blockSize = DEFAULT_BLOCK_SIZE;
+    VkDeviceSize nonCoherentAtomSize = 1;
+    uint32_t maxAllocationCount = 0;
+
+    std::vector<std::unique_ptr<Block>> blocks;
+    Stats stats;
+
+    bool allocateFromBlock(Block& block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset);
+    Block& createBlock(VkDeviceSize size, uint32_t memoryType, bool linear);
+};
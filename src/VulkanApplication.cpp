@@ -1,62 +1,339 @@
 ﻿#include "VulkanApplication.h"
 
+static VkDeviceSize alignSize(VkDeviceSize size, VkDeviceSize alignment)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
 void VulkanApplication::initVulkan()
 {
     instance.init();
     device.init(instance);
+    submissions.init();
     createCommandPool();
 
-    //    Output buffer
-    device.addBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, outBufferSize);
+    // A single frame needs a single slot
+    framesInFlight = std::max(1u, std::min(framesInFlight, frameCount));
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(device.getPhysical(), &properties);
+    outputSliceSize = alignSize(outBufferSize, properties.limits.minStorageBufferOffsetAlignment);
+    uniformSliceSize = alignSize(uniformBufferSize, properties.limits.minUniformBufferOffsetAlignment);
+
+    profiler.init(profile);
+    uploader.setProfiler(&profiler);
+
+    //    Output buffer, the shader writes stay in video memory and a copy after the dispatch brings them to a readback buffer
+    device.addBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, outputSliceSize * framesInFlight);
+    device.getBuffer(0).getDescriptor().range = outBufferSize;
+    createReadbackBuffers();
 
-    // Uniform buffer
-    device.addBuffer(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformBufferSize);
+    // Uniform buffer, kept mapped so every frame can write its own slice
+    device.addBuffer(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, uniformSliceSize * framesInFlight);
+    device.getBuffer(1).getDescriptor().range = uniformBufferSize;
+    if (device.getBuffer(1).map() != VK_SUCCESS)
+    {
+        throw std::runtime_error("failed to map uniform buffer!");
+    }
 
     createShapes();
 
-    VkCommandBuffer copyCmd;
-    VkBufferCopy copyRegion = {};
+    uploader.init();
 
-    addSSBOBuffer(shapes.data(), shapesBufferSize, copyCmd, copyRegion);
-    addSSBOBuffer(mesh, meshBufferSize, copyCmd, copyRegion);
+    profiler.beginPhase("upload");
 
-    addSSBOBuffer(bvh, bvhBufferSize, copyCmd, copyRegion);
-    addSSBOBuffer(blas.data(), blasBufferSize, copyCmd, copyRegion);
+    addSSBOBuffer(shapes.data(), shapesBufferSize);
+    addSSBOBuffer(mesh, meshBufferSize);
 
-    std::vector<VkDescriptorType> bufferTypes = {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER};
+    addSSBOBuffer(bvh.bvh, bvhBufferSize);
 
-    pipeline.init(device.getBuffers(), bufferTypes, "C:/dev/HelloVulkan/src/shaders/comp.spv");
+    addSSBOBuffer(bvh.triangles, blasBufferSize);
 
-    createCommandBuffer(commandBuffer);
-    finaliseMainCommandBuffer();
+    // Stats buffer, the shader counts BVH node visits into it when benchmarking
+    uint32_t stats[4] = {};
+    device.addBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, sizeof(stats), stats);
+
+    // Position and normal pools the triangles index
+    addSSBOBuffer(bvh.positions, positionsBufferSize);
+    addSSBOBuffer(bvh.normals, normalsBufferSize);
+
+    // The levels of the TLAS and the exact bounds of its nodes, for the refit pass before every frame
+    if (deform)
+    {
+        addSSBOBuffer(refitSchedule.nodes.data(), refitSchedule.nodes.size() * sizeof(uint32_t));
+        device.addBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, Primitives::tlasNodeCount(bvh) * 2 * sizeof(glm::vec4));
+    }
+
+    // All scene buffers are copied in a single submission, the pipeline is created while it runs
+    uploader.flush();
+
+    profiler.endPhase("upload");
+
+    // The output and uniform buffers are bound at the offset of the frame's slice
+    std::vector<VkDescriptorType> bufferTypes = {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                                 VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                                 VK_DESCRIPTOR_TYPE_STORAGE_BUFFER};
+    if (deform)
+    {
+        bufferTypes.insert(bufferTypes.end(), 2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+    }
+
+    std::vector<uint32_t> specializationConstants = {static_cast<uint32_t>(outputFormat), tonemapOutput ? VK_TRUE : VK_FALSE, benchmark ? VK_TRUE : VK_FALSE, bvh.bvh->nodeWidth,
+                                                     bvh.bvh->compressed ? VK_TRUE : VK_FALSE};
+
+    pipeline.init(device.getBuffers(), bufferTypes, "C:/dev/HelloVulkan/src/shaders/comp.spv", specializationConstants);
+
+    // Same buffers at the same bindings, the level to refit is passed as push constants
+    if (deform)
+    {
+        std::vector<uint32_t> refitConstants = {bvh.bvh->nodeWidth, bvh.bvh->compressed ? VK_TRUE : VK_FALSE};
+        refitPipeline.init(device.getBuffers(), bufferTypes, "C:/dev/HelloVulkan/src/shaders/refit.spv", refitConstants, 2 * sizeof(uint32_t));
+    }
+
+    commandBuffers.resize(framesInFlight);
+    for (uint32_t slot = 0; slot < framesInFlight; slot++)
+    {
+        recordFrameCommandBuffer(slot);
+    }
+
+    // Frames submitted later are ordered after the copies by the queue, this only collects the upload's profile
+    uploader.finish();
 }
 
 void VulkanApplication::mainLoop()
 {
-    updateUniformBuffers();
-    runCommandBuffer(commandBuffer, false, false);
-    vkDeviceWaitIdle(device.getLogical());
+    if (benchmark)
+    {
+        updateUniformBuffers(0, 0);
+        if (deform)
+        {
+            uploadDeformedMesh(0);
+        }
+        runBenchmark();
+
+        if (validate)
+        {
+            validateFrame(0, 0);
+        }
+
+        profiler.beginPhase("readback");
+        saveRenderedImage(0, getFrameFileName(0));
+        profiler.endPhase("readback");
+
+        endProfilerFrame();
+        return;
+    }
+
+    // Up to framesInFlight frames are queued on the GPU while earlier ones are read back and encoded on the thread pool
+    ThreadPool &pool = ThreadPool::global();
+    uint32_t submitted = 0;
+    for (uint32_t frame = 0; frame < frameCount; frame++)
+    {
+        profiler.beginPhase("dispatch");
+        for (; submitted < frameCount && submitted < frame + framesInFlight; submitted++)
+        {
+            uint32_t slot = submitted % framesInFlight;
+            pool.wait(*encodeGroups[slot]);
+
+            updateUniformBuffers(submitted, slot);
+
+            if (deform)
+            {
+                uploadDeformedMesh(submitted);
+            }
+
+            submitFrame(slot);
+        }
+        profiler.endPhase("dispatch");
+
+        uint32_t slot = frame % framesInFlight;
+
+        profiler.beginPhase("readback");
+        waitFrame(slot);
+        if (validate)
+        {
+            validateFrame(frame, slot);
+        }
+        std::string fileName = getFrameFileName(frame);
+        pool.spawn(*encodeGroups[slot], [this, slot, fileName]() { saveRenderedImage(slot, fileName); });
+        profiler.endPhase("readback");
+
+        endProfilerFrame();
+    }
 
-    saveRenderedImage();
+    for (auto &group : encodeGroups)
+    {
+        pool.wait(*group);
+    }
+    submissions.waitAll();
 }
 
-void VulkanApplication::cleanup()
+void VulkanApplication::endProfilerFrame()
 {
-    if (mesh)
+    profiler.endFrame(profileFile.is_open() ? profileFile : std::cout);
+}
+
+void VulkanApplication::runBenchmark()
+{
+    auto &statsBuffer = device.getBuffer(6);
+    statsBuffer.map();
+    uint32_t *nodeVisitCounter = (uint32_t *)statsBuffer.mapped;
+
+    // The counter is read back and cleared every frame so it can't overflow
+    uint64_t nodeVisits = 0;
+    double seconds = 0.0;
+    for (uint32_t frame = 0; frame < BENCHMARK_FRAMES; frame++)
     {
-        //        free(bvh->nodes);
-        //        free(bvh);
-        delete[] mesh;
+        *nodeVisitCounter = 0;
+
+        profiler.beginPhase("dispatch");
+        auto start = std::chrono::steady_clock::now();
+        submitFrame(0);
+        waitFrame(0);
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        profiler.endPhase("dispatch");
+
+        nodeVisits += *nodeVisitCounter;
+
+        // The readback after the last frame is reported by mainLoop
+        if (frame + 1 < BENCHMARK_FRAMES)
+        {
+            endProfilerFrame();
+        }
+    }
+    statsBuffer.unmap();
+
+    std::cout << "Benchmark " << (benchmarkScene.empty() ? "scene" : benchmarkScene) << ": " << bvh.triangleCount << " triangles, " << BENCHMARK_FRAMES << " frames, "
+              << seconds * 1000.0 / BENCHMARK_FRAMES << " ms per frame, "
+              << double(WIDTH) * HEIGHT * BENCHMARK_FRAMES / seconds / 1e6 << " M primary rays/s, "
+              << nodeVisits / double(WIDTH * HEIGHT * BENCHMARK_FRAMES) << " " << bvh.bvh->nodeWidth << "-wide nodes per pixel, "
+              << nodeVisits / seconds / 1e6 << " M nodes/s" << std::endl;
+
+    VulkanAllocator::Stats memoryStats = device.getAllocator().getStats();
+    std::cout << "GPU memory: " << memoryStats.allocationCount << " buffers in " << memoryStats.blockCount << " allocations, "
+              << memoryStats.usedBytes / (1024.0 * 1024.0) << " MB used of " << memoryStats.reservedBytes / (1024.0 * 1024.0) << " MB" << std::endl;
+}
+
+void VulkanApplication::runCpuRenderer()
+{
+    createShapes();
+
+    CpuRenderer renderer;
+    renderer.setScene(shapes.data(), shapes.size(), bvh);
+
+    std::vector<char> output(outBufferSize);
+    double seconds = 0.0;
+    double refitSeconds = 0.0;
+    for (uint32_t frame = 0; frame < frameCount; frame++)
+    {
+        UBOCompute uniforms = makeUniforms(frame);
+
+        if (deform)
+        {
+            auto refitStart = std::chrono::steady_clock::now();
+            deformMesh(frame, true);
+            refitSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - refitStart).count();
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        renderer.render(uniforms.lightPos, uniforms.camera, output.data(), outputFormat == OutputFormat::RGBA8, tonemapOutput);
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        writeImage(output.data(), getFrameFileName(frame));
+    }
+
+    std::cout << "CPU renderer: " << bvh.triangleCount << " triangles, " << frameCount << " frames, "
+              << seconds * 1000.0 / frameCount << " ms per frame, "
+              << double(WIDTH) * HEIGHT * frameCount / seconds / 1e6 << " M primary rays/s" << std::endl;
+    if (deform)
+    {
+        std::cout << "BVH refit: " << refitSeconds * 1000.0 / frameCount << " ms per frame" << std::endl;
+    }
+
+    destroyShapes();
+}
+
+void VulkanApplication::validateFrame(uint32_t frame, uint32_t slot)
+{
+    // Later frames may already have moved the vertices, the CPU renders the positions of this one
+    if (deform)
+    {
+        deformMesh(frame, true);
+    }
+
+    CpuRenderer renderer;
+    renderer.setScene(shapes.data(), shapes.size(), bvh);
+
+    UBOCompute uniforms = makeUniforms(frame);
+    std::vector<char> reference(outBufferSize);
+    renderer.render(uniforms.lightPos, uniforms.camera, reference.data(), outputFormat == OutputFormat::RGBA8, tonemapOutput);
+
+    // The GPU may contract multiplies and adds differently, so a channel may be off by one step of 1/255 before a pixel counts as different
+    const void *rendered = readbackBuffers[slot].mapped;
+    uint32_t differentPixels = 0;
+    float maxDifference = 0.0f;
+    for (uint32_t i = 0; i < WIDTH * HEIGHT; i++)
+    {
+        float pixelDifference = 0.0f;
+        for (uint32_t channel = 0; channel < 4; channel++)
+        {
+            float expected, actual;
+            if (outputFormat == OutputFormat::RGBA8)
+            {
+                expected = ((const unsigned char *)reference.data())[i * 4 + channel] / 255.0f;
+                actual = ((const unsigned char *)rendered)[i * 4 + channel] / 255.0f;
+            }
+            else
+            {
+                expected = ((const glm::vec4 *)reference.data())[i][channel];
+                actual = ((const glm::vec4 *)rendered)[i][channel];
+            }
+            pixelDifference = std::max(pixelDifference, std::abs(expected - actual));
+        }
+
+        if (pixelDifference > 1.0f / 255.0f + 1e-6f)
+        {
+            differentPixels++;
+        }
+        maxDifference = std::max(maxDifference, pixelDifference);
     }
 
+    std::cout << "Validation frame " << frame << ": " << differentPixels << " of " << WIDTH * HEIGHT << " pixels differ from the CPU renderer, max difference "
+              << maxDifference << std::endl;
+}
+
+void VulkanApplication::cleanup()
+{
+    destroyShapes();
+
+    submissions.waitAll();
+
+    device.getBuffer(1).unmap();
     for (auto &buf : device.getBuffers())
     {
         buf.destroy();
     }
-    destroyCommandBuffer(commandBuffer, false);
+    for (uint32_t slot = 0; slot < framesInFlight; slot++)
+    {
+        readbackBuffers[slot].unmap();
+        readbackBuffers[slot].destroy();
+        destroyCommandBuffer(commandBuffers[slot], false);
+    }
+    readbackBuffers.clear();
+    commandBuffers.clear();
+    frameTickets.clear();
+    encodeGroups.clear();
+    uploader.destroy();
+    submissions.destroy();
+    profiler.destroy();
     vkDestroyCommandPool(device.getLogical(), commandPool, nullptr);
 
     pipeline.destroy();
+    if (deform)
+    {
+        refitPipeline.destroy();
+    }
+    device.getAllocator().destroy();
     vkDestroyDevice(device.getLogical(), nullptr);
 }
 
@@ -104,12 +381,109 @@ void VulkanApplication::destroyCommandBuffer(VkCommandBuffer &cmdBuffer, bool en
     vkFreeCommandBuffers(device.getLogical(), commandPool, 1, &cmdBuffer);
 }
 
-void VulkanApplication::finaliseMainCommandBuffer()
+void VulkanApplication::createReadbackBuffers()
+{
+    for (uint32_t slot = 0; slot < framesInFlight; slot++)
+    {
+        readbackBuffers.emplace_back(device.getLogical(), device.getPhysical(), &device.getAllocator());
+        readbackBuffers[slot].init(VK_BUFFER_USAGE_TRANSFER_DST_BIT, getReadbackMemoryFlags(), outBufferSize);
+
+        // Kept mapped, the CPU reads the image straight from it once the frame's submission completed
+        if (readbackBuffers[slot].map() != VK_SUCCESS)
+        {
+            throw std::runtime_error("failed to map readback buffer!");
+        }
+        frameTickets.push_back(0);
+
+        encodeGroups.push_back(std::make_unique<ThreadPool::TaskGroup>());
+    }
+}
+
+VkMemoryPropertyFlags VulkanApplication::getReadbackMemoryFlags()
+{
+    // Cached memory makes the CPU reads fast, every implementation has coherent host memory to fall back on
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    vkGetPhysicalDeviceMemoryProperties(device.getPhysical(), &memoryProperties);
+
+    VkMemoryPropertyFlags cached = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
+    {
+        if ((memoryProperties.memoryTypes[i].propertyFlags & cached) == cached)
+        {
+            return cached;
+        }
+    }
+
+    return VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+}
+
+void VulkanApplication::recordFrameCommandBuffer(uint32_t slot)
 {
-    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.getPipelineLayout(), 0, 1, &pipeline.getDescriptorSet(), 0, NULL);
+    VkCommandBuffer &commandBuffer = commandBuffers[slot];
+    createCommandBuffer(commandBuffer);
+
+    auto &outputBuffer = device.getBuffer(0);
+
+    VkDeviceSize outputOffset = slot * outputSliceSize;
+
+    // Dynamic offsets in binding order, output buffer then uniform buffer
+    uint32_t dynamicOffsets[2] = {static_cast<uint32_t>(outputOffset), static_cast<uint32_t>(slot * uniformSliceSize)};
+    if (deform)
+    {
+        recordRefit(commandBuffer, dynamicOffsets);
+    }
+
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline.getPipelineLayout(), 0, 1, &pipeline.getDescriptorSet(), 2, dynamicOffsets);
     vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
 
+    // The queries are reset and written again on every submission of the command buffer
+    profiler.cmdBegin(commandBuffer, "dispatch", true, slot);
     vkCmdDispatch(commandBuffer, (uint32_t)ceil(WIDTH / float(WORKGROUP_SIZE)), (uint32_t)ceil(HEIGHT / float(WORKGROUP_SIZE)), 1);
+    profiler.cmdEnd(commandBuffer, "dispatch", slot);
+
+    // runBenchmark reads the node visits the shader counted into the stats buffer once the frame completed
+    if (benchmark)
+    {
+        VkBufferMemoryBarrier statsBarrier{};
+        statsBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        statsBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        statsBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        statsBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        statsBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        statsBarrier.buffer = device.getBuffer(6).getBuffer();
+        statsBarrier.offset = 0;
+        statsBarrier.size = VK_WHOLE_SIZE;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &statsBarrier, 0, nullptr);
+    }
+
+    VkBufferMemoryBarrier renderedBarrier{};
+    renderedBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    renderedBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    renderedBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    renderedBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    renderedBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    renderedBarrier.buffer = outputBuffer.getBuffer();
+    renderedBarrier.offset = outputOffset;
+    renderedBarrier.size = outBufferSize;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1, &renderedBarrier, 0, nullptr);
+
+    profiler.cmdBegin(commandBuffer, "readback", false, slot);
+    VkBufferCopy region{};
+    region.srcOffset = outputOffset;
+    region.size = outBufferSize;
+    vkCmdCopyBuffer(commandBuffer, outputBuffer.getBuffer(), readbackBuffers[slot].getBuffer(), 1, &region);
+    profiler.cmdEnd(commandBuffer, "readback", slot);
+
+    VkBufferMemoryBarrier readbackBarrier{};
+    readbackBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    readbackBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    readbackBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    readbackBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    readbackBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    readbackBarrier.buffer = readbackBuffers[slot].getBuffer();
+    readbackBarrier.offset = 0;
+    readbackBarrier.size = VK_WHOLE_SIZE;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &readbackBarrier, 0, nullptr);
 
     if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
     {
@@ -117,6 +491,48 @@ void VulkanApplication::finaliseMainCommandBuffer()
     }
 }
 
+void VulkanApplication::recordRefit(VkCommandBuffer commandBuffer, const uint32_t *dynamicOffsets)
+{
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, refitPipeline.getPipelineLayout(), 0, 1, &refitPipeline.getDescriptorSet(), 2, dynamicOffsets);
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, refitPipeline);
+
+    // A level reads the bounds the one before wrote, the first waits for the earlier frames still reading the TLAS
+    // and the last makes the refit TLAS visible to the frame's dispatch
+    VkMemoryBarrier levelBarrier{};
+    levelBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    levelBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    levelBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+    for (size_t level = 0; level + 1 < refitSchedule.levels.size(); level++)
+    {
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &levelBarrier, 0, nullptr, 0, nullptr);
+
+        uint32_t levelRange[2] = {refitSchedule.levels[level], refitSchedule.levels[level + 1] - refitSchedule.levels[level]};
+        vkCmdPushConstants(commandBuffer, refitPipeline.getPipelineLayout(), VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(levelRange), levelRange);
+        vkCmdDispatch(commandBuffer, (levelRange[1] + REFIT_WORKGROUP_SIZE - 1) / REFIT_WORKGROUP_SIZE, 1, 1);
+    }
+
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &levelBarrier, 0, nullptr, 0, nullptr);
+}
+
+void VulkanApplication::submitFrame(uint32_t slot)
+{
+    frameTickets[slot] = submissions.submit(commandBuffers[slot]);
+}
+
+void VulkanApplication::waitFrame(uint32_t slot)
+{
+    submissions.wait(frameTickets[slot]);
+
+    if (readbackBuffers[slot].invalidate() != VK_SUCCESS)
+    {
+        throw std::runtime_error("failed to invalidate readback buffer!");
+    }
+
+    profiler.collect("dispatch", slot);
+    profiler.collect("readback", slot);
+}
+
 void VulkanApplication::runCommandBuffer(VkCommandBuffer cmdBuffer, bool end, bool free)
 {
     if (cmdBuffer == VK_NULL_HANDLE)
@@ -129,84 +545,119 @@ void VulkanApplication::runCommandBuffer(VkCommandBuffer cmdBuffer, bool end, bo
         vkEndCommandBuffer(cmdBuffer);
     }
 
-    VkSubmitInfo submitInfo{};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &cmdBuffer;
-    // Create fence to ensure that the command buffer has finished executing
-    VkFenceCreateInfo fenceInfo{};
-    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fenceInfo.flags = 0;
-    VkFence fence;
+    // Submit to the queue and wait for the command buffer to finish executing
+    submissions.wait(submissions.submit(cmdBuffer));
 
-    if (vkCreateFence(device.getLogical(), &fenceInfo, nullptr, &fence) != VK_SUCCESS)
-    {
-        throw std::runtime_error("failed to create fence!");
-    }
-    // Submit to the queue
-    if (vkQueueSubmit(device.getQueue(), 1, &submitInfo, fence) != VK_SUCCESS)
-    {
-        throw std::runtime_error("failed to submit command buffer to queue!");
-    }
-    // Wait for the fence to signal that command buffer has finished executing
-    if (vkWaitForFences(device.getLogical(), 1, &fence, VK_TRUE, DEFAULT_FENCE_TIMEOUT) != VK_SUCCESS)
-    {
-        throw std::runtime_error("failed to wait for fence!");
-    }
-    vkDestroyFence(device.getLogical(), fence, nullptr);
     if (free)
     {
         vkFreeCommandBuffers(device.getLogical(), commandPool, 1, &cmdBuffer);
     }
 }
 
-void VulkanApplication::saveRenderedImage()
+void VulkanApplication::saveRenderedImage(uint32_t slot, const std::string &fileName)
 {
-    void *mappedMemory = nullptr;
-    // Map the buffer memory, so that we can read from it on the CPU.
-    vkMapMemory(device.getLogical(), device.getBuffer(0).getMemory(), 0, outBufferSize, 0, &mappedMemory);
-    glm::vec4 *pmappedMemory = (glm::vec4 *)mappedMemory;
+    // The readback buffer stays mapped, waitFrame made the copy visible to the CPU
+    writeImage(readbackBuffers[slot].mapped, fileName);
+}
 
-    // Get the color data from the buffer, and cast it to bytes.
-    // We save the data to a vector.
-    std::vector<unsigned char> image;
-    image.reserve(WIDTH * HEIGHT * 4);
-    for (int i = 0; i < WIDTH * HEIGHT; i += 1)
+void VulkanApplication::writeImage(const void *pixels, const std::string &fileName)
+{
+    if (outputFormat == OutputFormat::RGBA8)
     {
-        image.push_back((unsigned char)(255.0f * (pmappedMemory[i].r)));
-        image.push_back((unsigned char)(255.0f * (pmappedMemory[i].g)));
-        image.push_back((unsigned char)(255.0f * (pmappedMemory[i].b)));
-        image.push_back((unsigned char)(255.0f * (pmappedMemory[i].a)));
+        // The pixels are already packed to bytes. PAM takes them straight from memory, PPM drops the alpha channel in a copy.
+        if (writePAM)
+        {
+            ImageWriter::writeToPAM(fileName, (const unsigned char *)pixels, WIDTH, HEIGHT);
+        }
+        else
+        {
+            ImageWriter::writeToBinaryPPM(fileName, (const unsigned char *)pixels, WIDTH, HEIGHT);
+        }
     }
-    // Done reading, so unmap.
-    vkUnmapMemory(device.getLogical(), device.getBuffer(0).getMemory());
+    else
+    {
+        const glm::vec4 *pmappedMemory = (const glm::vec4 *)pixels;
+
+        // Get the color data from the buffer, and pack it to bytes like packUnorm4x8 in the shader,
+        // tonemapped first like the RGBA8 output. We save the data to a vector.
+        std::vector<unsigned char> image;
+        image.reserve(WIDTH * HEIGHT * 4);
+        for (int i = 0; i < WIDTH * HEIGHT; i += 1)
+        {
+            glm::vec4 colour = pmappedMemory[i];
+            if (tonemapOutput)
+            {
+                glm::vec3 rgb = glm::vec3(colour);
+                colour = glm::vec4(rgb / (glm::vec3(1.0f) + rgb), colour.a);
+            }
+
+            for (int c = 0; c < 4; c++)
+            {
+                image.push_back((unsigned char)std::round(255.0f * std::min(std::max(colour[c], 0.0f), 1.0f)));
+            }
+        }
+
+        // Now we save the acquired color data to a .png.
+        //unsigned error = lodepng::encode("mandelbrot.png", image, WIDTH, HEIGHT);
+        //if (error)
+        //    printf("encoder error %d: %s", error, lodepng_error_text(error));
+
+        if (writePAM)
+        {
+            ImageWriter::writeToPAM(fileName, image.data(), WIDTH, HEIGHT);
+        }
+        else
+        {
+            ImageWriter::writeToBinaryPPM(fileName, image.data(), WIDTH, HEIGHT);
+        }
+    }
+}
 
-    // Now we save the acquired color data to a .png.
-    //unsigned error = lodepng::encode("mandelbrot.png", image, WIDTH, HEIGHT);
-    //if (error)
-    //    printf("encoder error %d: %s", error, lodepng_error_text(error));
+std::string VulkanApplication::getFrameFileName(uint32_t frame)
+{
+    std::string extension = writePAM ? ".pam" : ".ppm";
+    if (frameCount == 1)
+    {
+        return "mandelbrot" + extension;
+    }
 
-    ImageWriter::writeToPPM("mandelbrot.ppm", image, WIDTH, HEIGHT);
+    char number[16];
+    snprintf(number, sizeof(number), "%04u", frame);
+    return std::string("mandelbrot_") + number + extension;
 }
 
-void VulkanApplication::updateUniformBuffers()
+UBOCompute VulkanApplication::makeUniforms(uint32_t frame)
 {
+    UBOCompute uniforms;
+
     float timer = 0.f;
-    //    ubo.lightPos.x = 0.0f + sin(glm::radians(timer * 360.0f)) * cos(glm::radians(timer * 360.0f)) * 2.0f;
-    //    ubo.lightPos.y = 0.0f + sin(glm::radians(timer * 360.0f)) * 2.0f;
-    //    ubo.lightPos.z = 0.0f + cos(glm::radians(timer * 360.0f)) * 2.0f;
+    //    uniforms.lightPos.x = 0.0f + sin(glm::radians(timer * 360.0f)) * cos(glm::radians(timer * 360.0f)) * 2.0f;
+    //    uniforms.lightPos.y = 0.0f + sin(glm::radians(timer * 360.0f)) * 2.0f;
+    //    uniforms.lightPos.z = 0.0f + cos(glm::radians(timer * 360.0f)) * 2.0f;
+
+    uniforms.lightPos.x = 10.0f;
+    uniforms.lightPos.y = 10.0f;
+    uniforms.lightPos.z = -10.0f;
+    uniforms.lightPos.w = 1.0f; //TODO check if this is right - should it be 0?
+
+    // Camera path: one orbit around the target over the whole sequence, a single frame uses the start position
+    glm::vec4 target(0.f, 1.f, 0.f, 1.f);
+    glm::vec4 offset(1.f, 2.f, -5.f, 0.f);
+    float angle = glm::radians(360.0f * frame / frameCount);
+    glm::vec4 position = target + glm::vec4(offset.x * cos(angle) + offset.z * sin(angle), offset.y, offset.z * cos(angle) - offset.x * sin(angle), 0.f);
 
-    ubo.lightPos.x = 10.0f;
-    ubo.lightPos.y = 10.0f;
-    ubo.lightPos.z = -10.0f;
-    ubo.lightPos.w = 1.0f; //TODO check if this is right - should it be 0?
+    uniforms.camera = Primitives::makeCamera(position, target, glm::vec4(0.f, 1.f, 0.f, 0.f), WIDTH, HEIGHT, 1.0472f);
 
-    ubo.camera = Primitives::makeCamera(glm::vec4(1.f, 3.f, -5.f, 1.f), glm::vec4(0.f, 1.f, 0.f, 1.f), glm::vec4(0.f, 1.f, 0.f, 0.f), WIDTH, HEIGHT, 1.0472f);
+    return uniforms;
+}
+
+void VulkanApplication::updateUniformBuffers(uint32_t frame, uint32_t slot)
+{
+    ubo = makeUniforms(frame);
 
+    // The uniform buffer is host coherent, the submission that follows sees the write
     auto &uniformBuffer = device.getBuffer(1);
-    uniformBuffer.map();
-    memcpy(uniformBuffer.mapped, &ubo, sizeof(ubo));
-    uniformBuffer.unmap();
+    memcpy((char *)uniformBuffer.mapped + slot * uniformSliceSize, &ubo, sizeof(ubo));
 }
 
 void VulkanApplication::createShapes()
@@ -226,8 +677,38 @@ void VulkanApplication::createShapes()
     //    Primitives::Shape s = Primitives::makeSphere(mat, sT);
     mesh = Primitives::makeMesh("C:/dev/HelloVulkan/assets/models/cube.obj", mat, sT, meshBufferSize);
 
-    std::tie(bvh, blas) = Primitives::makeBVH("C:/dev/HelloVulkan/assets/models/armadillo.obj", mat, sT, bvhBufferSize);
-    blasBufferSize = blas.size() * sizeof(Primitives::NodeBLAS);
+    Primitives::BVHSettings bvhSettings;
+    bvhSettings.mode = Primitives::BVHBuildMode::SAH;
+    bvhSettings.width = bvhWidth;
+    bvhSettings.compress = compressBVH;
+
+    if (benchmark && benchmarkScene.empty())
+    {
+        bvh = Primitives::makeBVH(Primitives::makeBenchmarkTriangles(BENCHMARK_TRIANGLES), "benchmark", mat, sT, bvhSettings);
+    }
+    else if (benchmark)
+    {
+        bvh = Primitives::makeBVH(benchmarkScene, mat, sT, bvhSettings, benchmarkScene + ".bvhcache");
+    }
+    else
+    {
+        bvh = Primitives::makeBVH("C:/dev/HelloVulkan/assets/models/armadillo.obj", mat, sT, bvhSettings, "C:/dev/HelloVulkan/assets/models/armadillo.bvhcache");
+    }
+    bvhBufferSize = bvh.bvhSize;
+    blasBufferSize = bvh.trianglesSize;
+    positionsBufferSize = bvh.positionsSize;
+    normalsBufferSize = bvh.normalsSize;
+
+    if (deform)
+    {
+        restPositions = Primitives::readPoolPositions(bvh);
+        restBounds = Primitives::emptyBoundsUnion();
+        for (const glm::vec4 &position : restPositions)
+        {
+            restBounds = Primitives::mergeBounds(restBounds, Primitives::triangleBounds(position, position, position));
+        }
+        refitSchedule = Primitives::makeRefitSchedule(bvh);
+    }
 
     //    bvhBufferSize += 16;
 
@@ -240,47 +721,87 @@ void VulkanApplication::createShapes()
     //    bvhBufferSize = sizeof(*bvh) + 16; //TODO is this plus 16, and why is size so low
 }
 
-void VulkanApplication::addSSBOBuffer(void *buffer, size_t bufferSize, VkCommandBuffer &copyCmd, VkBufferCopy copyRegion)
+void VulkanApplication::destroyShapes()
 {
-    device.addBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, bufferSize);
+    if (mesh)
+    {
+        //        free(bvh->nodes);
+        //        free(bvh);
+        delete[] mesh;
+        mesh = nullptr;
+    }
 
-    device.addBuffer(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, bufferSize, buffer);
+    bvh = Primitives::BVHBuffers();
+    shapes.clear();
+    restPositions.clear();
+    refitSchedule = Primitives::RefitSchedule();
+}
 
-    createCommandBuffer(copyCmd);
-    copyRegion.size = bufferSize;
-    vkCmdCopyBuffer(copyCmd, device.getBuffer(device.getBuffers().size() - 1).getBuffer(), device.getBuffer(device.getBuffers().size() - 2).getBuffer(), 1, &copyRegion);
-    runCommandBuffer(copyCmd, true, true);
+void VulkanApplication::deformMesh(uint32_t frame, bool refitHost)
+{
+    // A wave along x moves the vertices up and down by 5% of the mesh's height, it travels one period over the sequence
+    glm::vec4 extent = restBounds.second - restBounds.first;
+    float amplitude = 0.05f * extent.y;
+    float frequency = glm::radians(360.0f) / std::max(extent.x, 1e-6f);
+    float phase = glm::radians(360.0f * frame / frameCount);
+
+    std::vector<glm::vec4> positions(restPositions.size());
+    ThreadPool::global().parallelFor(0, positions.size(), 4096, [&](uint32_t positionBegin, uint32_t positionEnd) {
+        for (uint32_t i = positionBegin; i < positionEnd; i++)
+        {
+            positions[i] = restPositions[i];
+            positions[i].y += amplitude * sin(frequency * (restPositions[i].x - restBounds.first.x) - phase);
+        }
+    });
+
+    Primitives::writePoolPositions(bvh, positions);
+
+    // The GPU refits its own copy of the TLAS, the host one is only needed by the CPU renderer
+    if (refitHost)
+    {
+        Primitives::refitBVH(bvh, refitSchedule);
+    }
+}
 
-    device.getBuffer(device.getBuffers().size() - 1).destroy();
-    device.getBuffers().pop_back();
+void VulkanApplication::uploadDeformedMesh(uint32_t frame)
+{
+    // The positions pool is binding 7, the frame's command buffer refits the TLAS to it before rendering. The host doesn't wait,
+    // the copy waits on the GPU until the frame before stopped reading the pool.
+    deformMesh(frame, false);
+    uploader.upload(device.getBuffer(7).getBuffer(), bvh.positions, positionsBufferSize);
+    uploader.flush();
 }
 
-// #include <chrono>
-// using namespace std::chrono;
+void VulkanApplication::addSSBOBuffer(const void *buffer, size_t bufferSize)
+{
+    device.addBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, bufferSize);
+
+    uploader.upload(device.getBuffers().back().getBuffer(), buffer, bufferSize);
+}
 
 void VulkanApplication::run()
 {
-    // auto start = high_resolution_clock::now();
-    initVulkan();
-    // auto stop = high_resolution_clock::now();
-    // auto duration = duration_cast<seconds>(stop - start);
-    // std::cout << duration.count() << std::endl;
+    if (cpuRenderer)
+    {
+        runCpuRenderer();
+        return;
+    }
 
-    // auto start = high_resolution_clock::now();
-    mainLoop();
-    // auto stop = high_resolution_clock::now();
-    // auto duration = duration_cast<microseconds>(stop - start);
-    // std::cout << duration.count() << std::endl;
+    if (profile && !profilePath.empty())
+    {
+        profileFile.open(profilePath, std::ios::app);
+        if (!profileFile)
+        {
+            throw std::runtime_error("failed to open profile output " + profilePath);
+        }
+    }
 
-    // start = high_resolution_clock::now();
+    initVulkan();
+    mainLoop();
     cleanup();
-
-    // stop = high_resolution_clock::now();
-    // duration = duration_cast<microseconds>(stop - start);
-    // std::cout << duration.count() << std::endl;
 }
 
-VulkanApplication::VulkanApplication() : pipeline(device.getLogical())
+VulkanApplication::VulkanApplication() : pipeline(device.getLogical(), device.getPhysical()), refitPipeline(device.getLogical(), device.getPhysical()), submissions(device), uploader(device, submissions), profiler(device)
 {
 }
 
@@ -288,11 +809,79 @@ VulkanApplication::~VulkanApplication()
 {
 }
 
-int main()
+int main(int argc, char **argv)
 {
     VulkanApplication app;
 
-    app.outBufferSize = sizeof(glm::vec4) * WIDTH * HEIGHT;
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::string(argv[i]) == "--benchmark")
+        {
+            app.benchmark = true;
+
+            // Optional OBJ file to benchmark instead of the generated scene, e.g. the armadillo
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+            {
+                app.benchmarkScene = argv[++i];
+            }
+        }
+        else if (std::string(argv[i]) == "--frames" && i + 1 < argc)
+        {
+            app.frameCount = std::max(std::stoi(argv[++i]), 1);
+        }
+        else if (std::string(argv[i]) == "--frames-in-flight" && i + 1 < argc)
+        {
+            app.framesInFlight = std::min(std::max(std::stoi(argv[++i]), 1), (int)MAX_FRAMES_IN_FLIGHT);
+        }
+        else if (std::string(argv[i]) == "--bvh-width" && i + 1 < argc)
+        {
+            app.bvhWidth = std::stoi(argv[++i]);
+            if (app.bvhWidth != 2 && app.bvhWidth != 4 && app.bvhWidth != 8)
+            {
+                throw std::runtime_error("--bvh-width must be 2, 4 or 8");
+            }
+        }
+        else if (std::string(argv[i]) == "--compress-bvh")
+        {
+            app.compressBVH = true;
+        }
+        else if (std::string(argv[i]) == "--tonemap")
+        {
+            app.tonemapOutput = true;
+        }
+        else if (std::string(argv[i]) == "--float-output")
+        {
+            app.outputFormat = OutputFormat::RGBA32F;
+        }
+        else if (std::string(argv[i]) == "--pam")
+        {
+            app.writePAM = true;
+        }
+        else if (std::string(argv[i]) == "--deform")
+        {
+            app.deform = true;
+        }
+        else if (std::string(argv[i]) == "--cpu")
+        {
+            app.cpuRenderer = true;
+        }
+        else if (std::string(argv[i]) == "--validate")
+        {
+            app.validate = true;
+        }
+        else if (std::string(argv[i]) == "--profile")
+        {
+            app.profile = true;
+
+            // Optional JSON lines file the frames are appended to, stdout otherwise
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+            {
+                app.profilePath = argv[++i];
+            }
+        }
+    }
+
+    app.outBufferSize = (app.outputFormat == OutputFormat::RGBA8 ? sizeof(uint32_t) : sizeof(glm::vec4)) * WIDTH * HEIGHT;
     app.uniformBufferSize = sizeof(UBOCompute);
     //    app.uniformBufferSize = 0;
 
@@ -7,8 +7,12 @@
 #include "VulkanInstance.h"
 #include "VulkanDevice.h"
 #include "VulkanPipeline.h"
+#include "VulkanSubmitTracker.h"
+#include "VulkanUploader.h"
+#include "VulkanProfiler.h"
 
 #include "Primitives.h"
+#include "CpuRenderer.h"
 
 #include "lodepng.h"
 #include "ImageWriter.h"
@@ -17,13 +21,28 @@
 
 #include <iostream>
 #include <fstream>
+#include <cstdio>
 #include <vector>
 
 const uint32_t WIDTH = 1600;
 const uint32_t HEIGHT = 1200;
 const uint32_t WORKGROUP_SIZE = 32;
+const uint32_t REFIT_WORKGROUP_SIZE = 64; // matches WORKGROUP_SIZE in refit.comp
 
-const uint64_t DEFAULT_FENCE_TIMEOUT = 100000000000;
+// Frames rendered at the same time, each has its own slice of the output and uniform buffers, readback buffer, command buffer and fence
+const uint32_t DEFAULT_FRAMES_IN_FLIGHT = 2;
+const uint32_t MAX_FRAMES_IN_FLIGHT = 8;
+
+// Micro-benchmark scene, run with --benchmark [scene.obj]
+const uint32_t BENCHMARK_TRIANGLES = 1 << 18;
+const uint32_t BENCHMARK_FRAMES = 20;
+
+// Layout of the output buffer, matches OUTPUT_MODE in raytracer.comp
+enum class OutputFormat : uint32_t
+{
+    RGBA32F = 0,
+    RGBA8 = 1
+};
 
 #ifdef NDEBUG
 const bool enableValidationLayers = false;
@@ -51,37 +70,112 @@ public:
     size_t meshBufferSize;
     size_t bvhBufferSize;
     size_t blasBufferSize;
+    size_t positionsBufferSize;
+    size_t normalsBufferSize;
     size_t outBufferSize;
 
+    // Layout the shader writes the pixels in, --float-output keeps the unclamped RGBA32F colours in the output buffer
+    OutputFormat outputFormat = OutputFormat::RGBA8;
+
+    // Reinhard tonemaps the colours before they are packed to bytes, with --tonemap
+    bool tonemapOutput = false;
+
+    // Writes the frames as PAM, which keeps the alpha channel, instead of PPM with --pam. RGBA8 frames are then written straight
+    // from the mapped output buffer.
+    bool writePAM = false;
+
+    // Number of frames of the camera path rendered and written out, a sequence is numbered mandelbrot_0000.ppm...
+    uint32_t frameCount = 1;
+    uint32_t framesInFlight = DEFAULT_FRAMES_IN_FLIGHT;
+
+    // Renders the micro-benchmark scene, or the OBJ file benchmarkScene, BENCHMARK_FRAMES times and reports BVH nodes visited per second
+    bool benchmark = false;
+    std::string benchmarkScene;
+
+    // Children per BVH node, the binary tree by default. --bvh-width 4 or 8 collapses it into wide nodes tested four or eight at a time
+    uint32_t bvhWidth = 2;
+
+    // Quantizes the wide BVH nodes to bytes and stores the triangles as indices into a shared vertex pool, needs --bvh-width 4 or 8
+    bool compressBVH = false;
+
+    // Writes the CPU and GPU time of the upload, dispatch and readback phases of every frame as a line of JSON, to profilePath or stdout
+    bool profile = false;
+    std::string profilePath;
+
+    // Moves the vertices of the mesh with a wave over the camera path and refits the BVH before every frame, with refit.comp on the GPU
+    // or refitBVH with --cpu. The normals stay those of the rest pose. Every frame shares the positions, the TLAS and the refit bounds,
+    // so a frame's upload and refit wait on the GPU for the frame before to finish rendering. Frames are still queued up to
+    // framesInFlight ahead, but deforming limits pipelining to about 2 frames: one rendering while the one before is read back.
+    bool deform = false;
+
+    // Renders the frames with CpuRenderer instead of Vulkan, reports ms per frame
+    bool cpuRenderer = false;
+
+    // Renders every frame on the CPU as well and reports how many pixels of the GPU image differ from it
+    bool validate = false;
+
     std::vector<Primitives::Shape> shapes;
     Primitives::Mesh *mesh;
     
-    Primitives::BVH *bvh;
-    std::vector<Primitives::NodeBLAS> blas;
+    Primitives::BVHBuffers bvh;
 
 private:
     VulkanInstance instance;
     VulkanDevice device;
     VulkanPipeline pipeline;
+    VulkanPipeline refitPipeline;
+    VulkanSubmitTracker submissions;
+    VulkanUploader uploader;
+    VulkanProfiler profiler;
+    std::ofstream profileFile;
 
     VkCommandPool commandPool;
-    VkCommandBuffer commandBuffer;
+
+    // One command buffer, submission ticket and readback buffer per frame that can be in flight, the output and uniform buffers are split in aligned slices
+    std::vector<VkCommandBuffer> commandBuffers;
+    std::vector<SubmitTicket> frameTickets;
+    std::vector<VulkanBuffer> readbackBuffers;
+    VkDeviceSize outputSliceSize;
+    VkDeviceSize uniformSliceSize;
+
+    // Images are encoded on the thread pool, a slot is reused once the image of its previous frame is written
+    std::vector<std::unique_ptr<ThreadPool::TaskGroup>> encodeGroups;
+
+    // Positions and bounds of the undeformed mesh, and the levels of the TLAS the refit goes through
+    std::vector<glm::vec4> restPositions;
+    Primitives::NodeTLAS restBounds;
+    Primitives::RefitSchedule refitSchedule;
 
     void initWindow();
     void initVulkan();
     void mainLoop();
+    void runBenchmark();
+    void runCpuRenderer();
+    void validateFrame(uint32_t frame, uint32_t slot);
+    void endProfilerFrame();
     void cleanup();
     void createCommandPool();
     void createCommandBuffer(VkCommandBuffer &cmdBuffer);
     void destroyCommandBuffer(VkCommandBuffer &cmdBuffer, bool end);
-    void finaliseMainCommandBuffer();
+    void createReadbackBuffers();
+    VkMemoryPropertyFlags getReadbackMemoryFlags();
+    void recordFrameCommandBuffer(uint32_t slot);
+    void recordRefit(VkCommandBuffer commandBuffer, const uint32_t *dynamicOffsets);
+    void submitFrame(uint32_t slot);
+    void waitFrame(uint32_t slot);
     //    void flushCommandBuffer(VkCommandBuffer commandBuffer, bool free);
-    void addSSBOBuffer(void* buffer, size_t bufferSize, VkCommandBuffer& copyCmd, VkBufferCopy copyRegion);
+    void addSSBOBuffer(const void* buffer, size_t bufferSize);
 
     void runCommandBuffer(VkCommandBuffer commandBuffer, bool end, bool free);
 
-    void saveRenderedImage();
+    void saveRenderedImage(uint32_t slot, const std::string &fileName);
+    void writeImage(const void *pixels, const std::string &fileName);
+    std::string getFrameFileName(uint32_t frame);
 
-    void updateUniformBuffers();
+    UBOCompute makeUniforms(uint32_t frame);
+    void updateUniformBuffers(uint32_t frame, uint32_t slot);
     void createShapes();
+    void destroyShapes();
+    void deformMesh(uint32_t frame, bool refitHost);
+    void uploadDeformedMesh(uint32_t frame);
 };
@@ -10,7 +10,7 @@
 #include <cstring>
 #include <cassert>
  
-VulkanBuffer::VulkanBuffer(VkDevice& device, VkPhysicalDevice& physicalDevice) : device(device), physicalDevice(physicalDevice) {
+VulkanBuffer::VulkanBuffer(VkDevice& device, VkPhysicalDevice& physicalDevice, VulkanAllocator* allocator) : device(device), physicalDevice(physicalDevice), allocator(allocator) {
 }
 
 VulkanBuffer::~VulkanBuffer() {
@@ -23,10 +23,18 @@ void VulkanBuffer::destroy()
     {
         vkDestroyBuffer(device, buffer, nullptr);
     }
-    if (memory)
+    if (allocator)
+    {
+        allocator->free(allocation);
+    }
+    else if (memory)
     {
         vkFreeMemory(device, memory, nullptr);
     }
+
+    buffer = VK_NULL_HANDLE;
+    memory = VK_NULL_HANDLE;
+    allocation = VulkanAllocation();
 }
 
 void VulkanBuffer::init(VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags memoryPropertyFlags, VkDeviceSize size, void *data) {
@@ -39,6 +47,34 @@ void VulkanBuffer::init(VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags mem
     bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
     vkCreateBuffer(device, &bufferCreateInfo, nullptr, &buffer);
 
+    if (allocator) {
+        // Sub-allocated from one of the allocator's blocks, host visible blocks are already mapped
+        VkMemoryRequirements memReqs;
+        vkGetBufferMemoryRequirements(device, buffer, &memReqs);
+        allocation = allocator->allocate(memReqs, memoryPropertyFlags);
+        memory = allocation.memory;
+
+        if (data != nullptr) {
+            if (allocation.mapped == nullptr) {
+                throw std::runtime_error("failed to map buffer memory!");
+            }
+            memcpy(allocation.mapped, data, size);
+        }
+
+        if (vkBindBufferMemory(device, buffer, memory, allocation.offset) != VK_SUCCESS) {
+            throw std::runtime_error("failed to bind buffer memory!");
+        }
+    } else {
+        initDedicated(memoryPropertyFlags, size, data);
+    }
+
+    descriptorBufferInfo = {};
+    descriptorBufferInfo.buffer = buffer;
+    descriptorBufferInfo.offset = 0;
+    descriptorBufferInfo.range = size;
+}
+
+void VulkanBuffer::initDedicated(VkMemoryPropertyFlags memoryPropertyFlags, VkDeviceSize size, void *data) {
     // Create the memory backing up the buffer handle
     VkPhysicalDeviceMemoryProperties deviceMemoryProperties;
     vkGetPhysicalDeviceMemoryProperties(physicalDevice, &deviceMemoryProperties);
@@ -71,20 +107,27 @@ void VulkanBuffer::init(VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags mem
         }
         memcpy(mapped, data, size);
         vkUnmapMemory(device, memory);
+        mapped = nullptr;
     }
 
     if (vkBindBufferMemory(device, buffer, memory, 0) != VK_SUCCESS) {
         throw std::runtime_error("failed to bind buffer memory!");
     }
-    
-    descriptorBufferInfo = {};
-    descriptorBufferInfo.buffer = buffer;
-    descriptorBufferInfo.offset = 0;
-    descriptorBufferInfo.range = size;
 }
 
 VkResult VulkanBuffer::map(VkDeviceSize size, VkDeviceSize offset)
 {
+    // Sub-allocated memory is shared with other buffers and stays mapped by the allocator
+    if (allocator)
+    {
+        if (allocation.mapped == nullptr)
+        {
+            return VK_ERROR_MEMORY_MAP_FAILED;
+        }
+        mapped = static_cast<char *>(allocation.mapped) + offset;
+        return VK_SUCCESS;
+    }
+
     return vkMapMemory(device, memory, offset, size, 0, &mapped);
 }
 
@@ -92,11 +135,35 @@ void VulkanBuffer::unmap()
 {
     if (mapped)
     {
-        vkUnmapMemory(device, memory);
+        if (!allocator)
+        {
+            vkUnmapMemory(device, memory);
+        }
         mapped = nullptr;
     }
 }
 
+VkResult VulkanBuffer::invalidate(VkDeviceSize size, VkDeviceSize offset)
+{
+    VkMappedMemoryRange mappedRange {};
+    mappedRange.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    mappedRange.memory = memory;
+    mappedRange.offset = offset;
+    mappedRange.size = size;
+
+    // Ranges are relative to the whole memory object, the allocator aligned the allocation to nonCoherentAtomSize
+    if (allocator)
+    {
+        if (allocation.hostCoherent)
+        {
+            return VK_SUCCESS;
+        }
+        mappedRange.offset = allocation.offset;
+        mappedRange.size = allocation.size;
+    }
+    return vkInvalidateMappedMemoryRanges(device, 1, &mappedRange);
+}
+
 VkBuffer& VulkanBuffer::getBuffer() {
     return buffer;
 }
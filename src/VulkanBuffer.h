@@ -10,6 +10,8 @@
 #include <vulkan/vulkan.h>
 #include <iostream>
 
+#include "VulkanAllocator.h"
+
 class VulkanBuffer {
 private:
     VkBuffer buffer;
@@ -18,9 +20,15 @@ private:
     
     VkDevice& device;
     VkPhysicalDevice& physicalDevice;
+
+    //  Without an allocator the buffer gets a memory allocation of its own
+    VulkanAllocator* allocator;
+    VulkanAllocation allocation;
+
+    void initDedicated(VkMemoryPropertyFlags memoryPropertyFlags, VkDeviceSize size, void *data);
     
 public:
-    VulkanBuffer(VkDevice& parentDevice, VkPhysicalDevice& parentPhysicalDevice);
+    VulkanBuffer(VkDevice& parentDevice, VkPhysicalDevice& parentPhysicalDevice, VulkanAllocator* parentAllocator = nullptr);
     void init(VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags memoryPropertyFlags, VkDeviceSize size, void *data = nullptr);
     virtual ~VulkanBuffer();
     
@@ -28,6 +36,8 @@ public:
     
     VkResult map(VkDeviceSize size = VK_WHOLE_SIZE, VkDeviceSize offset = 0);
     void unmap();
+    //  Makes device writes visible to the mapping, needed when the memory isn't HOST_COHERENT
+    VkResult invalidate(VkDeviceSize size = VK_WHOLE_SIZE, VkDeviceSize offset = 0);
     
     void* mapped = nullptr;
     
@@ -1,12 +1,13 @@
 #include "VulkanDevice.h"
 
-VulkanDevice::VulkanDevice() {
+VulkanDevice::VulkanDevice() : allocator(vkDevice, vkPhysicalDevice) {
     
 }
 
 void VulkanDevice::init(const VkInstance& vkInstance) {
     pickPhysicalDevice(vkInstance);
     createLogicalDevice();
+    allocator.init();
     
     buffers.reserve(5);
 }
@@ -99,8 +100,28 @@ void VulkanDevice::createLogicalDevice() {
         queueCreateInfos.push_back(queueCreateInfo);
     }
 
-    VkPhysicalDeviceFeatures deviceFeatures{};
+    VkPhysicalDeviceFeatures supportedFeatures;
+    vkGetPhysicalDeviceFeatures(vkPhysicalDevice, &supportedFeatures);
+
+    // Pipeline statistics are only used for profiling, devices without them still work
+    deviceFeatures = VkPhysicalDeviceFeatures{};
     deviceFeatures.robustBufferAccess = VK_TRUE;
+    deviceFeatures.pipelineStatisticsQuery = supportedFeatures.pipelineStatisticsQuery;
+
+    // Timeline semaphores are core in Vulkan 1.2, older devices track submissions with fences instead
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(vkPhysicalDevice, &properties);
+
+    VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures{};
+    timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+    if (properties.apiVersion >= VK_API_VERSION_1_2) {
+        VkPhysicalDeviceFeatures2 features2{};
+        features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        features2.pNext = &timelineFeatures;
+        vkGetPhysicalDeviceFeatures2(vkPhysicalDevice, &features2);
+    }
+    timelineSemaphoreSupported = timelineFeatures.timelineSemaphore == VK_TRUE;
+    timelineFeatures.pNext = nullptr;
 
     VkDeviceCreateInfo createInfo{};
     createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -109,6 +130,7 @@ void VulkanDevice::createLogicalDevice() {
     createInfo.pQueueCreateInfos = queueCreateInfos.data();
 
     createInfo.pEnabledFeatures = &deviceFeatures;
+    createInfo.pNext = timelineSemaphoreSupported ? &timelineFeatures : nullptr;
 
     createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
     createInfo.ppEnabledExtensionNames = deviceExtensions.data();
@@ -143,8 +165,20 @@ QueueFamilyIndices& VulkanDevice::getQueueFamilyIndices() {
     return indices;
 }
 
+const VkPhysicalDeviceFeatures& VulkanDevice::getEnabledFeatures() const {
+    return deviceFeatures;
+}
+
+VulkanAllocator& VulkanDevice::getAllocator() {
+    return allocator;
+}
+
+bool VulkanDevice::supportsTimelineSemaphore() const {
+    return timelineSemaphoreSupported;
+}
+
 void VulkanDevice::addBuffer(VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags memoryPropertyFlags, VkDeviceSize size, void *data) {
-    buffers.emplace_back(this->vkDevice, this->vkPhysicalDevice);
+    buffers.emplace_back(this->vkDevice, this->vkPhysicalDevice, &allocator);
     buffers.back().init(usageFlags, memoryPropertyFlags, size, data);
 
 //    return buffers.size() - 1;
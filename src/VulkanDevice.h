@@ -8,6 +8,7 @@
 #include <iostream>
 
 #include "VulkanBuffer.h"
+#include "VulkanAllocator.h"
 // #include <memory>
 // #include <fstream>
 // #include <stdexcept>
@@ -44,15 +45,20 @@ public:
     VulkanBuffer& getBuffer(uint32_t index);
     std::vector<VulkanBuffer>& getBuffers();
     QueueFamilyIndices& getQueueFamilyIndices();
+    VulkanAllocator& getAllocator();
+    const VkPhysicalDeviceFeatures& getEnabledFeatures() const;
+    bool supportsTimelineSemaphore() const;
     
 //    TODO add implicit casting so this class returns logical device, instead of having to call getLogical
 private:
     VkPhysicalDevice vkPhysicalDevice = VK_NULL_HANDLE;
-//    VkPhysicalDeviceFeatures deviceFeatures;
+    VkPhysicalDeviceFeatures deviceFeatures{};
+    bool timelineSemaphoreSupported = false;
     VkDevice vkDevice = VK_NULL_HANDLE;
     QueueFamilyIndices indices;
     VkQueue computeQueue;
     std::vector<VulkanBuffer> buffers;
+    VulkanAllocator allocator;
 
     void findQueueFamilies(VkPhysicalDevice device);
     bool isDeviceSuitable(VkPhysicalDevice device);
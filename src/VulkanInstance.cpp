@@ -1,11 +1,16 @@
 #include "VulkanInstance.h"
 
 std::vector<const char*> VulkanInstance::getRequiredExtensions() {
+#ifdef HEADLESS
+    // Compute only needs the core API, no surface extensions
+    std::vector<const char*> extensions;
+#else
     uint32_t glfwExtensionCount = 0;
     const char** glfwExtensions;
     glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
 
     std::vector<const char*> extensions(glfwExtensions, glfwExtensions + glfwExtensionCount);
+#endif
 
     if (enableValidationLayers) {
         extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <vulkan/vulkan.h>
+#ifndef HEADLESS
 #include <GLFW/glfw3.h>
+#endif
 
 #include "Validation.h"
 
@@ -1,7 +1,51 @@
 
 #include "VulkanPipeline.h"
 
-VulkanPipeline::VulkanPipeline(VkDevice& device) : device(device) {
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <sstream>
+
+namespace {
+    const char PIPELINE_CACHE_MAGIC[8] = {'H', 'V', 'P', 'I', 'P', 'E', 'C', 'A'};
+    const uint32_t PIPELINE_CACHE_VERSION = 1;
+
+    // Written in front of the vkGetPipelineCacheData blob
+    struct PipelineCacheFileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t vendorID;
+        uint32_t deviceID;
+        uint32_t driverVersion;
+        uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+        uint64_t shaderHash;
+        uint64_t dataSize;
+        uint64_t dataHash;
+    };
+
+    // Start of the blob returned by vkGetPipelineCacheData, as defined by the spec
+    struct PipelineCacheHeaderVersionOne {
+        uint32_t headerSize;
+        uint32_t headerVersion;
+        uint32_t vendorID;
+        uint32_t deviceID;
+        uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+    };
+
+    uint64_t hashData(const void* data, size_t size) {
+        // 64 bit FNV-1a
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+        }
+        return hash;
+    }
+}
+
+VulkanPipeline::VulkanPipeline(VkDevice& device, VkPhysicalDevice& physicalDevice) : device(device), physicalDevice(physicalDevice) {
 }
 
 VulkanPipeline::~VulkanPipeline() {
@@ -18,30 +62,32 @@ void VulkanPipeline::destroy() {
     vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
 }
 
-void VulkanPipeline::init(std::vector<VulkanBuffer>& buffers, std::vector<VkDescriptorType>& types, const std::string& shaderPath) {
-    createDescriptorPool();
+void VulkanPipeline::init(std::vector<VulkanBuffer>& buffers, std::vector<VkDescriptorType>& types, const std::string& shaderPath, const std::vector<uint32_t>& specializationConstants,
+                          uint32_t pushConstantBytes) {
+    specializationData = specializationConstants;
+    pushConstantSize = pushConstantBytes;
+
+    createDescriptorPool(types);
     createDescriptorSetLayout(types);
     createPipelineLayout();
     createDescriptorSet(buffers, types);
     createShader(shaderPath);
     createPipelineCache();
     createPipeline();
+    savePipelineCache();
 }
 
-void VulkanPipeline::createDescriptorPool() {
-    VkDescriptorPoolSize uniformDescriptorPoolSize = {};
-    uniformDescriptorPoolSize.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    uniformDescriptorPoolSize.descriptorCount = 1;
-    
-    VkDescriptorPoolSize imageDescriptorPoolSize = {}; // For output image
-    imageDescriptorPoolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    imageDescriptorPoolSize.descriptorCount = 1;
-    
-    VkDescriptorPoolSize primitivesDescriptorPoolSize = {}; // For buffers of shape primitives
-    primitivesDescriptorPoolSize.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-    primitivesDescriptorPoolSize.descriptorCount = 2; // Number of primitive buffers here
-    
-    std::vector<VkDescriptorPoolSize> poolSizes = {uniformDescriptorPoolSize,imageDescriptorPoolSize,primitivesDescriptorPoolSize};
+void VulkanPipeline::createDescriptorPool(std::vector<VkDescriptorType>& types) {
+    // One descriptor of each binding's type
+    std::vector<VkDescriptorPoolSize> poolSizes;
+    for (VkDescriptorType type : types) {
+        auto poolSize = std::find_if(poolSizes.begin(), poolSizes.end(), [type](const VkDescriptorPoolSize& size) { return size.type == type; });
+        if (poolSize == poolSizes.end()) {
+            poolSizes.push_back({type, 1});
+        } else {
+            poolSize->descriptorCount++;
+        }
+    }
 
     VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {};
     descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -119,6 +165,12 @@ void VulkanPipeline::createPipelineLayout() {
     pipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
     pipelineLayoutCreateInfo.setLayoutCount = 1;
     pipelineLayoutCreateInfo.pSetLayouts = &descriptorSetLayout;
+
+    VkPushConstantRange pushConstantRange = {VK_SHADER_STAGE_COMPUTE_BIT, 0, pushConstantSize};
+    if (pushConstantSize > 0) {
+        pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+        pipelineLayoutCreateInfo.pPushConstantRanges = &pushConstantRange;
+    }
     
     if (vkCreatePipelineLayout(device, &pipelineLayoutCreateInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
         throw std::runtime_error("failed to create pipeline layout!");
@@ -131,6 +183,18 @@ void VulkanPipeline::createPipeline() {
     compShaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
     compShaderStageInfo.module = shaderModule;
     compShaderStageInfo.pName = "main";
+
+    std::vector<VkSpecializationMapEntry> specializationEntries;
+    for (uint32_t i = 0; i < specializationData.size(); i++) {
+        specializationEntries.push_back({i, static_cast<uint32_t>(i * sizeof(uint32_t)), sizeof(uint32_t)});
+    }
+
+    VkSpecializationInfo specializationInfo{};
+    specializationInfo.mapEntryCount = static_cast<uint32_t>(specializationEntries.size());
+    specializationInfo.pMapEntries = specializationEntries.data();
+    specializationInfo.dataSize = specializationData.size() * sizeof(uint32_t);
+    specializationInfo.pData = specializationData.data();
+    compShaderStageInfo.pSpecializationInfo = &specializationInfo;
     
     VkComputePipelineCreateInfo pipelineCreateInfo = {};
     pipelineCreateInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
@@ -163,6 +227,9 @@ void VulkanPipeline::createShader(const std::string& shaderPath) {
     createInfo.codeSize = buffer.size();
     createInfo.pCode = reinterpret_cast<const uint32_t*>(buffer.data());
 
+    shaderHash = hashData(buffer.data(), buffer.size());
+    pipelineCachePath = shaderPath + ".pipelinecache";
+
     if (vkCreateShaderModule(device, &createInfo, nullptr, &shaderModule) != VK_SUCCESS) {
         throw std::runtime_error("failed to create shader module!");
     }
@@ -170,9 +237,130 @@ void VulkanPipeline::createShader(const std::string& shaderPath) {
 
 void VulkanPipeline::createPipelineCache()
 {
+    std::vector<char> initialData = loadPipelineCacheData();
+    initialCacheHash = initialData.empty() ? 0 : hashData(initialData.data(), initialData.size());
+
     VkPipelineCacheCreateInfo pipelineCacheCreateInfo = {};
     pipelineCacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
-    vkCreatePipelineCache(device, &pipelineCacheCreateInfo, nullptr, &pipelineCache);
+    pipelineCacheCreateInfo.initialDataSize = initialData.size();
+    pipelineCacheCreateInfo.pInitialData = initialData.empty() ? nullptr : initialData.data();
+
+    if (vkCreatePipelineCache(device, &pipelineCacheCreateInfo, nullptr, &pipelineCache) != VK_SUCCESS) {
+        // Drivers may still refuse a blob that passed our checks, start from an empty cache then
+        pipelineCacheCreateInfo.initialDataSize = 0;
+        pipelineCacheCreateInfo.pInitialData = nullptr;
+        initialCacheHash = 0;
+
+        if (vkCreatePipelineCache(device, &pipelineCacheCreateInfo, nullptr, &pipelineCache) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create pipeline cache!");
+        }
+    }
+}
+
+std::vector<char> VulkanPipeline::loadPipelineCacheData()
+{
+    std::ifstream file(pipelineCachePath, std::ios::ate | std::ios::binary);
+    if (!file.is_open()) {
+        return {};
+    }
+
+    size_t fileSize = (size_t) file.tellg();
+    if (fileSize < sizeof(PipelineCacheFileHeader) + sizeof(PipelineCacheHeaderVersionOne)) {
+        return {};
+    }
+
+    PipelineCacheFileHeader header;
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+    // Reject blobs from another device, driver or shader, and truncated files
+    if (memcmp(header.magic, PIPELINE_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != PIPELINE_CACHE_VERSION ||
+        header.vendorID != properties.vendorID || header.deviceID != properties.deviceID || header.driverVersion != properties.driverVersion ||
+        memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0 || header.shaderHash != shaderHash ||
+        header.dataSize != fileSize - sizeof(header)) {
+        return {};
+    }
+
+    std::vector<char> data(header.dataSize);
+    file.read(data.data(), data.size());
+
+    if (!file || hashData(data.data(), data.size()) != header.dataHash) {
+        return {};
+    }
+
+    // The blob starts with its own header, check it against the device too
+    PipelineCacheHeaderVersionOne cacheHeader;
+    memcpy(&cacheHeader, data.data(), sizeof(cacheHeader));
+
+    if (cacheHeader.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE || cacheHeader.headerSize < sizeof(cacheHeader) || cacheHeader.headerSize > data.size() ||
+        cacheHeader.vendorID != properties.vendorID || cacheHeader.deviceID != properties.deviceID ||
+        memcmp(cacheHeader.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+        return {};
+    }
+
+    return data;
+}
+
+void VulkanPipeline::savePipelineCache()
+{
+    size_t dataSize = 0;
+    if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, nullptr) != VK_SUCCESS || dataSize == 0) {
+        return;
+    }
+
+    std::vector<char> data(dataSize);
+    if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, data.data()) != VK_SUCCESS) {
+        return;
+    }
+    data.resize(dataSize);
+
+    // Nothing new was compiled
+    if (hashData(data.data(), data.size()) == initialCacheHash) {
+        return;
+    }
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+    PipelineCacheFileHeader header = {};
+    memcpy(header.magic, PIPELINE_CACHE_MAGIC, sizeof(header.magic));
+    header.version = PIPELINE_CACHE_VERSION;
+    header.vendorID = properties.vendorID;
+    header.deviceID = properties.deviceID;
+    header.driverVersion = properties.driverVersion;
+    memcpy(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+    header.shaderHash = shaderHash;
+    header.dataSize = data.size();
+    header.dataHash = hashData(data.data(), data.size());
+
+    // Write to a temporary file first so concurrent jobs never read a partial cache, its name is unique so they never
+    // write into each other's either
+    std::ostringstream tempSuffix;
+    tempSuffix << ".tmp" << std::hex << std::random_device()() << std::chrono::steady_clock::now().time_since_epoch().count();
+    std::string tempPath = pipelineCachePath + tempSuffix.str();
+    {
+        std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(data.data(), data.size());
+
+        if (!file) {
+            std::cout << "failed to write pipeline cache: " << tempPath << std::endl;
+            file.close();
+            std::remove(tempPath.c_str());
+            return;
+        }
+    }
+
+    if (std::rename(tempPath.c_str(), pipelineCachePath.c_str()) != 0) {
+        std::remove(pipelineCachePath.c_str());
+        if (std::rename(tempPath.c_str(), pipelineCachePath.c_str()) != 0) {
+            std::cout << "failed to write pipeline cache: " << pipelineCachePath << std::endl;
+            std::remove(tempPath.c_str());
+        }
+    }
 }
 
 
@@ -4,6 +4,7 @@
 #include <vector>
 #include <fstream>
 #include <iostream>
+#include <string>
 
 #include "VulkanBuffer.h"
 
@@ -17,22 +18,34 @@ private:
     VkShaderModule shaderModule;
     VkPipelineCache pipelineCache;
     
-    void createDescriptorPool();
+    void createDescriptorPool(std::vector<VkDescriptorType>& types);
     void createDescriptorSet(std::vector<VulkanBuffer>& buffers, std::vector<VkDescriptorType>& types);
     void createDescriptorSetLayout(std::vector<VkDescriptorType>& types);
     void createPipelineLayout();
     void createPipeline();
     void createShader(const std::string& shaderPath);
     void createPipelineCache();
+    void savePipelineCache();
+    std::vector<char> loadPipelineCacheData();
     
     VkDevice& device;
+    VkPhysicalDevice& physicalDevice;
+    std::vector<uint32_t> specializationData;
+    uint32_t pushConstantSize = 0;
+
+    // The pipeline cache is stored next to the shader, keyed by the device and the SPIR-V it was built from
+    std::string pipelineCachePath;
+    uint64_t shaderHash = 0;
+    uint64_t initialCacheHash = 0;
     
 public:
-    VulkanPipeline(VkDevice& parentDevice);
+    VulkanPipeline(VkDevice& parentDevice, VkPhysicalDevice& parentPhysicalDevice);
     ~VulkanPipeline();
     void destroy();
     operator VkPipeline() const { return pipeline; };
-    void init(std::vector<VulkanBuffer>& buffers, std::vector<VkDescriptorType>& types, const std::string& shaderPath);
+    // specializationConstants[i] is passed to the shader as constant_id i, pushConstantBytes is the size of its push constant block
+    void init(std::vector<VulkanBuffer>& buffers, std::vector<VkDescriptorType>& types, const std::string& shaderPath, const std::vector<uint32_t>& specializationConstants = {},
+              uint32_t pushConstantBytes = 0);
     
     const VkPipelineLayout& getPipelineLayout();
     const VkDescriptorSet& getDescriptorSet();
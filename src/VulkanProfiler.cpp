@@ -0,0 +1,192 @@
+#include "VulkanProfiler.h"
+
+#include <iomanip>
+#include <vector>
+
+VulkanProfiler::VulkanProfiler(VulkanDevice& device) : device(device) {
+}
+
+VulkanProfiler::~VulkanProfiler() {
+}
+
+void VulkanProfiler::init(bool enable) {
+    enabled = enable;
+    if (!enabled) {
+        return;
+    }
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(device.getPhysical(), &properties);
+    timestampPeriod = properties.limits.timestampPeriod;
+
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(device.getPhysical(), &queueFamilyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(device.getPhysical(), &queueFamilyCount, queueFamilies.data());
+
+    uint32_t validBits = queueFamilies[device.getQueueFamilyIndices().computeFamily.value()].timestampValidBits;
+    timestampsSupported = validBits > 0;
+    timestampMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+    statisticsSupported = device.getEnabledFeatures().pipelineStatisticsQuery == VK_TRUE;
+
+    if (timestampsSupported) {
+        VkQueryPoolCreateInfo queryPoolInfo{};
+        queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryPoolInfo.queryCount = 2 * MAX_QUERY_SLOTS;
+
+        if (vkCreateQueryPool(device.getLogical(), &queryPoolInfo, nullptr, &timestampPool) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create timestamp query pool!");
+        }
+    }
+
+    if (statisticsSupported) {
+        VkQueryPoolCreateInfo queryPoolInfo{};
+        queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        queryPoolInfo.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+        queryPoolInfo.queryCount = MAX_QUERY_SLOTS;
+        queryPoolInfo.pipelineStatistics = VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT;
+
+        if (vkCreateQueryPool(device.getLogical(), &queryPoolInfo, nullptr, &statisticsPool) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create pipeline statistics query pool!");
+        }
+    }
+}
+
+void VulkanProfiler::destroy() {
+    if (timestampPool) {
+        vkDestroyQueryPool(device.getLogical(), timestampPool, nullptr);
+    }
+    if (statisticsPool) {
+        vkDestroyQueryPool(device.getLogical(), statisticsPool, nullptr);
+    }
+
+    timestampPool = VK_NULL_HANDLE;
+    statisticsPool = VK_NULL_HANDLE;
+    enabled = false;
+}
+
+bool VulkanProfiler::isEnabled() const {
+    return enabled;
+}
+
+VulkanProfiler::Slot& VulkanProfiler::getSlot(const std::string& name, uint32_t copy) {
+    auto key = std::make_pair(name, copy);
+    auto slot = slots.find(key);
+    if (slot == slots.end()) {
+        if (slots.size() == MAX_QUERY_SLOTS) {
+            throw std::runtime_error("too many profiled phases!");
+        }
+        slot = slots.emplace(key, Slot{static_cast<uint32_t>(slots.size())}).first;
+    }
+    return slot->second;
+}
+
+void VulkanProfiler::beginPhase(const std::string& name) {
+    if (!enabled) {
+        return;
+    }
+
+    phases[name].cpuStart = std::chrono::steady_clock::now();
+}
+
+void VulkanProfiler::endPhase(const std::string& name) {
+    if (!enabled) {
+        return;
+    }
+
+    Phase& phase = phases[name];
+    phase.cpuMilliseconds += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - phase.cpuStart).count();
+}
+
+void VulkanProfiler::cmdBegin(VkCommandBuffer commandBuffer, const std::string& name, bool pipelineStatistics, uint32_t copy) {
+    if (!enabled) {
+        return;
+    }
+
+    Slot& slot = getSlot(name, copy);
+    slot.pipelineStatistics = pipelineStatistics && statisticsSupported;
+
+    if (timestampsSupported) {
+        vkCmdResetQueryPool(commandBuffer, timestampPool, 2 * slot.index, 2);
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampPool, 2 * slot.index);
+    }
+    if (slot.pipelineStatistics) {
+        vkCmdResetQueryPool(commandBuffer, statisticsPool, slot.index, 1);
+        vkCmdBeginQuery(commandBuffer, statisticsPool, slot.index, 0);
+    }
+}
+
+void VulkanProfiler::cmdEnd(VkCommandBuffer commandBuffer, const std::string& name, uint32_t copy) {
+    if (!enabled) {
+        return;
+    }
+
+    Slot& slot = getSlot(name, copy);
+
+    if (slot.pipelineStatistics) {
+        vkCmdEndQuery(commandBuffer, statisticsPool, slot.index);
+    }
+    if (timestampsSupported) {
+        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampPool, 2 * slot.index + 1);
+    }
+}
+
+void VulkanProfiler::collect(const std::string& name, uint32_t copy) {
+    auto key = std::make_pair(name, copy);
+    if (!enabled || slots.find(key) == slots.end()) {
+        return;
+    }
+
+    Slot& slot = slots[key];
+    Phase& phase = phases[name];
+
+    if (timestampsSupported) {
+        uint64_t timestamps[2];
+        if (vkGetQueryPoolResults(device.getLogical(), timestampPool, 2 * slot.index, 2, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) == VK_SUCCESS) {
+            uint64_t ticks = ((timestamps[1] & timestampMask) - (timestamps[0] & timestampMask)) & timestampMask;
+            phase.gpuMilliseconds += ticks * timestampPeriod / 1e6;
+            phase.hasGpuTime = true;
+        }
+    }
+
+    if (slot.pipelineStatistics) {
+        uint64_t invocations = 0;
+        if (vkGetQueryPoolResults(device.getLogical(), statisticsPool, slot.index, 1, sizeof(invocations), &invocations, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) == VK_SUCCESS) {
+            phase.computeInvocations += invocations;
+            phase.hasStatistics = true;
+        }
+    }
+}
+
+void VulkanProfiler::endFrame(std::ostream& out) {
+    if (!enabled) {
+        return;
+    }
+
+    out << std::fixed << std::setprecision(4) << "{\"frame\": " << frame << ", \"phases\": {";
+
+    bool first = true;
+    for (auto& entry : phases) {
+        const Phase& phase = entry.second;
+
+        out << (first ? "" : ", ") << "\"" << entry.first << "\": {\"cpu_ms\": " << phase.cpuMilliseconds << ", \"gpu_ms\": ";
+        if (phase.hasGpuTime) {
+            out << phase.gpuMilliseconds;
+        } else {
+            out << "null";
+        }
+        if (phase.hasStatistics) {
+            out << ", \"compute_invocations\": " << phase.computeInvocations;
+        }
+        out << "}";
+
+        first = false;
+    }
+
+    out << "}}" << std::endl;
+    out << std::defaultfloat;
+
+    phases.clear();
+    frame++;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <chrono>
+#include <map>
+#include <ostream>
+#include <string>
+#include <utility>
+
+#include "VulkanDevice.h"
+
+//  Per-frame CPU and GPU timings of named phases (upload, dispatch, readback...). The CPU time of a phase is
+//  measured between beginPhase and endPhase, its GPU time by timestamp queries recorded with cmdBegin and cmdEnd
+//  around its commands, optionally with a pipeline statistics query counting compute shader invocations.
+//  collect() adds the query results to the phase once the submission completed, endFrame() writes the frame as
+//  one line of JSON and starts the next one. Command buffers that can be in flight together record their queries
+//  of a phase into different copies, the results of all copies add up to the same phase.
+class VulkanProfiler {
+public:
+    VulkanProfiler(VulkanDevice& parentDevice);
+    ~VulkanProfiler();
+
+    void init(bool enable);
+    void destroy();
+    bool isEnabled() const;
+
+    void beginPhase(const std::string& name);
+    void endPhase(const std::string& name);
+
+    void cmdBegin(VkCommandBuffer commandBuffer, const std::string& name, bool pipelineStatistics = false, uint32_t copy = 0);
+    void cmdEnd(VkCommandBuffer commandBuffer, const std::string& name, uint32_t copy = 0);
+    void collect(const std::string& name, uint32_t copy = 0);
+
+    void endFrame(std::ostream& out);
+
+private:
+    static const uint32_t MAX_QUERY_SLOTS = 64;
+
+    //  Queries of a phase, timestamps at 2 * slot and 2 * slot + 1, statistics at slot
+    struct Slot {
+        uint32_t index;
+        bool pipelineStatistics = false;
+    };
+
+    struct Phase {
+        std::chrono::steady_clock::time_point cpuStart;
+        double cpuMilliseconds = 0.0;
+        double gpuMilliseconds = 0.0;
+        uint64_t computeInvocations = 0;
+        bool hasGpuTime = false;
+        bool hasStatistics = false;
+    };
+
+    VulkanDevice& device;
+    bool enabled = false;
+    bool timestampsSupported = false;
+    bool statisticsSupported = false;
+    uint64_t timestampMask = 0;
+    double timestampPeriod = 1.0;
+
+    VkQueryPool timestampPool = VK_NULL_HANDLE;
+    VkQueryPool statisticsPool = VK_NULL_HANDLE;
+
+    std::map<std::pair<std::string, uint32_t>, Slot> slots;
+    std::map<std::string, Phase> phases;
+    uint64_t frame = 0;
+
+    Slot& getSlot(const std::string& name, uint32_t copy);
+};
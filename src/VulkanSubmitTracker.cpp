@@ -0,0 +1,162 @@
+#include "VulkanSubmitTracker.h"
+
+#include <algorithm>
+
+VulkanSubmitTracker::VulkanSubmitTracker(VulkanDevice& device) : device(device) {
+}
+
+VulkanSubmitTracker::~VulkanSubmitTracker() {
+}
+
+void VulkanSubmitTracker::init() {
+    timeline = device.supportsTimelineSemaphore();
+    if (!timeline) {
+        return;
+    }
+
+    VkSemaphoreTypeCreateInfo typeInfo{};
+    typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    typeInfo.initialValue = 0;
+
+    VkSemaphoreCreateInfo semaphoreInfo{};
+    semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphoreInfo.pNext = &typeInfo;
+
+    if (vkCreateSemaphore(device.getLogical(), &semaphoreInfo, nullptr, &semaphore) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create timeline semaphore!");
+    }
+}
+
+void VulkanSubmitTracker::destroy() {
+    waitAll();
+
+    if (semaphore) {
+        vkDestroySemaphore(device.getLogical(), semaphore, nullptr);
+    }
+    for (VkFence fence : freeFences) {
+        vkDestroyFence(device.getLogical(), fence, nullptr);
+    }
+
+    semaphore = VK_NULL_HANDLE;
+    freeFences.clear();
+}
+
+SubmitTicket VulkanSubmitTracker::submit(VkCommandBuffer commandBuffer) {
+    SubmitTicket ticket = lastSubmitted + 1;
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+
+    VkTimelineSemaphoreSubmitInfo timelineInfo{};
+    VkFence fence = VK_NULL_HANDLE;
+
+    if (timeline) {
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.signalSemaphoreValueCount = 1;
+        timelineInfo.pSignalSemaphoreValues = &ticket;
+
+        submitInfo.pNext = &timelineInfo;
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &semaphore;
+    } else {
+        fence = acquireFence();
+    }
+
+    if (vkQueueSubmit(device.getQueue(), 1, &submitInfo, fence) != VK_SUCCESS) {
+        if (fence) {
+            freeFences.push_back(fence);
+        }
+        throw std::runtime_error("failed to submit command buffer to queue!");
+    }
+
+    if (!timeline) {
+        pendingFences.emplace_back(ticket, fence);
+    }
+
+    lastSubmitted = ticket;
+    return ticket;
+}
+
+bool VulkanSubmitTracker::isComplete(SubmitTicket ticket) {
+    if (ticket <= lastCompleted) {
+        return true;
+    }
+
+    if (timeline) {
+        uint64_t value = 0;
+        if (vkGetSemaphoreCounterValue(device.getLogical(), semaphore, &value) != VK_SUCCESS) {
+            throw std::runtime_error("failed to read timeline semaphore!");
+        }
+        lastCompleted = std::max(lastCompleted, value);
+    } else {
+        // Fences are checked in submission order, the first one still pending ends the search
+        while (!pendingFences.empty() && vkGetFenceStatus(device.getLogical(), pendingFences.front().second) == VK_SUCCESS) {
+            retireFence();
+        }
+    }
+
+    return ticket <= lastCompleted;
+}
+
+void VulkanSubmitTracker::wait(SubmitTicket ticket, uint64_t timeout) {
+    if (ticket <= lastCompleted) {
+        return;
+    }
+
+    if (timeline) {
+        VkSemaphoreWaitInfo waitInfo{};
+        waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        waitInfo.semaphoreCount = 1;
+        waitInfo.pSemaphores = &semaphore;
+        waitInfo.pValues = &ticket;
+
+        if (vkWaitSemaphores(device.getLogical(), &waitInfo, timeout) != VK_SUCCESS) {
+            throw std::runtime_error("failed to wait for timeline semaphore!");
+        }
+        lastCompleted = ticket;
+    } else {
+        while (!pendingFences.empty() && pendingFences.front().first <= ticket) {
+            if (vkWaitForFences(device.getLogical(), 1, &pendingFences.front().second, VK_TRUE, timeout) != VK_SUCCESS) {
+                throw std::runtime_error("failed to wait for fence!");
+            }
+            retireFence();
+        }
+    }
+}
+
+void VulkanSubmitTracker::waitAll() {
+    wait(lastSubmitted);
+}
+
+bool VulkanSubmitTracker::usesTimelineSemaphore() const {
+    return timeline;
+}
+
+VkFence VulkanSubmitTracker::acquireFence() {
+    if (!freeFences.empty()) {
+        VkFence fence = freeFences.back();
+        freeFences.pop_back();
+        return fence;
+    }
+
+    VkFenceCreateInfo fenceInfo{};
+    fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+    VkFence fence;
+    if (vkCreateFence(device.getLogical(), &fenceInfo, nullptr, &fence) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create fence!");
+    }
+    return fence;
+}
+
+void VulkanSubmitTracker::retireFence() {
+    auto pending = pendingFences.front();
+    pendingFences.pop_front();
+
+    vkResetFences(device.getLogical(), 1, &pending.second);
+    freeFences.push_back(pending.second);
+    lastCompleted = pending.first;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <deque>
+#include <utility>
+#include <vector>
+
+#include "VulkanDevice.h"
+
+//  Submissions to the compute queue are numbered, the number is a ticket the caller can poll or wait on.
+//  Tickets are values of one timeline semaphore when the device has them, otherwise every submission signals
+//  a fence taken from a pool that gets it back once the submission completed. Submissions to the queue run
+//  in order, so commands that depend on earlier ones can be submitted without waiting for them on the host.
+typedef uint64_t SubmitTicket;
+
+class VulkanSubmitTracker {
+public:
+    static const uint64_t DEFAULT_TIMEOUT = 100000000000;
+
+    VulkanSubmitTracker(VulkanDevice& parentDevice);
+    ~VulkanSubmitTracker();
+
+    void init();
+    void destroy();
+
+    SubmitTicket submit(VkCommandBuffer commandBuffer);
+
+    bool isComplete(SubmitTicket ticket);
+    void wait(SubmitTicket ticket, uint64_t timeout = DEFAULT_TIMEOUT);
+
+    //  Waits for everything submitted so far
+    void waitAll();
+
+    bool usesTimelineSemaphore() const;
+
+private:
+    VulkanDevice& device;
+    bool timeline = false;
+    VkSemaphore semaphore = VK_NULL_HANDLE;
+
+    SubmitTicket lastSubmitted = 0;
+    SubmitTicket lastCompleted = 0;
+
+    //  Fence fallback, fences of the submissions not known to be complete oldest first, and the recycled ones
+    std::deque<std::pair<SubmitTicket, VkFence>> pendingFences;
+    std::vector<VkFence> freeFences;
+
+    VkFence acquireFence();
+    void retireFence();
+};
@@ -0,0 +1,203 @@
+#include "VulkanUploader.h"
+
+#include <algorithm>
+#include <cstring>
+
+VulkanUploader::VulkanUploader(VulkanDevice& device, VulkanSubmitTracker& tracker) : device(device), tracker(tracker), staging(device.getLogical(), device.getPhysical(), &device.getAllocator()) {
+}
+
+VulkanUploader::~VulkanUploader() {
+}
+
+void VulkanUploader::init(VkDeviceSize size) {
+    stagingSize = size;
+    head = 0;
+    used = 0;
+    pendingSize = 0;
+
+    VkCommandPoolCreateInfo poolInfo{};
+    poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    poolInfo.queueFamilyIndex = device.getQueueFamilyIndices().computeFamily.value();
+
+    if (vkCreateCommandPool(device.getLogical(), &poolInfo, nullptr, &commandPool) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create upload command pool!");
+    }
+
+    staging.init(VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingSize);
+    if (staging.map() != VK_SUCCESS) {
+        throw std::runtime_error("failed to map staging buffer memory!");
+    }
+}
+
+void VulkanUploader::destroy() {
+    finish();
+
+    staging.unmap();
+    staging.destroy();
+
+    // Destroying the pool frees its command buffers
+    vkDestroyCommandPool(device.getLogical(), commandPool, nullptr);
+    freeCommandBuffers.clear();
+
+    pendingCopies.clear();
+}
+
+VkDeviceSize VulkanUploader::reserve() {
+    while (true) {
+        retire(false);
+
+        // Wrap around at the end, or start over at the beginning when nothing is in use
+        if (used == 0 || head == stagingSize) {
+            head = 0;
+        }
+
+        // The bytes in use start at head - used, wrapped around the end of the ring
+        VkDeviceSize available = used == stagingSize ? 0 : head >= used ? stagingSize - head : stagingSize - used;
+        if (available > 0) {
+            return available;
+        }
+
+        // Everything in use is waiting for this flush, submit it before waiting for it
+        if (inFlight.empty()) {
+            flush();
+        }
+        retire(true);
+    }
+}
+
+void VulkanUploader::retire(bool wait) {
+    while (!inFlight.empty()) {
+        Batch& batch = inFlight.front();
+        if (wait) {
+            tracker.wait(batch.ticket);
+            wait = false;
+        } else if (!tracker.isComplete(batch.ticket)) {
+            return;
+        }
+
+        // Results are read before the next flush reuses the queries
+        if (profiler) {
+            profiler->collect("upload");
+        }
+
+        vkResetCommandBuffer(batch.commandBuffer, 0);
+        freeCommandBuffers.push_back(batch.commandBuffer);
+        used -= batch.size;
+        inFlight.pop_front();
+    }
+}
+
+void VulkanUploader::upload(VkBuffer dstBuffer, const void* data, VkDeviceSize size, VkDeviceSize dstOffset) {
+    const char* src = static_cast<const char*>(data);
+
+    // Uploads larger than the free space following head are split
+    while (size > 0) {
+        VkDeviceSize available = reserve();
+
+        VkDeviceSize copySize = std::min(size, available);
+        memcpy(static_cast<char*>(staging.mapped) + head, src, copySize);
+
+        VkBufferCopy region{};
+        region.srcOffset = head;
+        region.dstOffset = dstOffset;
+        region.size = copySize;
+        pendingCopies.push_back({dstBuffer, region});
+
+        // Keep copies 16 byte aligned in the ring
+        VkDeviceSize reserved = std::min(available, (copySize + 15) & ~VkDeviceSize(15));
+        head += reserved;
+        used += reserved;
+        pendingSize += reserved;
+
+        src += copySize;
+        dstOffset += copySize;
+        size -= copySize;
+    }
+}
+
+SubmitTicket VulkanUploader::flush() {
+    if (pendingCopies.empty()) {
+        return inFlight.empty() ? 0 : inFlight.back().ticket;
+    }
+
+    // The queries of the previous flush are collected before they are reset
+    if (profiler) {
+        finish();
+    }
+
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    if (!freeCommandBuffers.empty()) {
+        commandBuffer = freeCommandBuffers.back();
+        freeCommandBuffers.pop_back();
+    } else {
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = commandPool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandBufferCount = 1;
+
+        if (vkAllocateCommandBuffers(device.getLogical(), &allocInfo, &commandBuffer) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate upload command buffer!");
+        }
+    }
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+        throw std::runtime_error("failed to begin recording upload command buffer!");
+    }
+
+    if (profiler) {
+        profiler->cmdBegin(commandBuffer, "upload");
+    }
+
+    // Dispatches submitted earlier may still read the buffers the copies overwrite
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
+
+    // Consecutive copies into the same buffer go into one command
+    std::vector<VkBufferCopy> regions;
+    for (size_t i = 0; i < pendingCopies.size(); i++) {
+        regions.push_back(pendingCopies[i].region);
+
+        if (i + 1 == pendingCopies.size() || pendingCopies[i + 1].dstBuffer != pendingCopies[i].dstBuffer) {
+            vkCmdCopyBuffer(commandBuffer, staging.getBuffer(), pendingCopies[i].dstBuffer, static_cast<uint32_t>(regions.size()), regions.data());
+            regions.clear();
+        }
+    }
+
+    // Make the copies visible to the compute shaders submitted afterwards
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    if (profiler) {
+        profiler->cmdEnd(commandBuffer, "upload");
+    }
+
+    if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to record upload command buffer!");
+    }
+
+    SubmitTicket ticket = tracker.submit(commandBuffer);
+    inFlight.push_back({ticket, pendingSize, commandBuffer});
+
+    pendingCopies.clear();
+    pendingSize = 0;
+
+    return ticket;
+}
+
+void VulkanUploader::finish() {
+    while (!inFlight.empty()) {
+        retire(true);
+    }
+}
+
+void VulkanUploader::setProfiler(VulkanProfiler* uploadProfiler) {
+    profiler = uploadProfiler;
+}
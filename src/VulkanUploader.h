@@ -0,0 +1,75 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <deque>
+#include <vector>
+
+#include "VulkanBuffer.h"
+#include "VulkanDevice.h"
+#include "VulkanProfiler.h"
+#include "VulkanSubmitTracker.h"
+
+//  Uploads data to device local buffers through one persistently mapped staging ring. Uploads are copied
+//  into the ring straight away and the buffer copies are recorded into a command buffer on flush(), which
+//  submits them without waiting. Every flush holds its bytes of the ring until its submission completed, so
+//  several flushes can be in flight. An upload only waits when the ring has no free space left, for the
+//  oldest flush in flight, and flushes its own pending copies first when they fill the whole ring.
+class VulkanUploader {
+public:
+    static const VkDeviceSize DEFAULT_STAGING_SIZE = 64 * 1024 * 1024;
+
+    VulkanUploader(VulkanDevice& parentDevice, VulkanSubmitTracker& parentTracker);
+    ~VulkanUploader();
+
+    void init(VkDeviceSize stagingSize = DEFAULT_STAGING_SIZE);
+    void destroy();
+
+    void upload(VkBuffer dstBuffer, const void* data, VkDeviceSize size, VkDeviceSize dstOffset = 0);
+
+    //  Submits the pending copies, work submitted afterwards sees the uploaded data
+    SubmitTicket flush();
+
+    //  Waits for the copies in flight
+    void finish();
+
+    //  Times the copies of every flush as the "upload" phase of the profiler. Every flush reuses the same
+    //  queries, so while profiling a flush first waits for the one before.
+    void setProfiler(VulkanProfiler* uploadProfiler);
+
+private:
+    struct PendingCopy {
+        VkBuffer dstBuffer;
+        VkBufferCopy region;
+    };
+
+    //  A submitted flush, it holds the bytes of the ring written since the flush before it
+    struct Batch {
+        SubmitTicket ticket;
+        VkDeviceSize size;
+        VkCommandBuffer commandBuffer;
+    };
+
+    VulkanDevice& device;
+    VulkanSubmitTracker& tracker;
+    VulkanProfiler* profiler = nullptr;
+    VulkanBuffer staging;
+    VkDeviceSize stagingSize = 0;
+
+    //  The bytes in use are the used bytes before head, wrapping around the end of the ring. The newest
+    //  pendingSize of them belong to the copies not flushed yet, the others to the batches in flight.
+    VkDeviceSize head = 0;
+    VkDeviceSize used = 0;
+    VkDeviceSize pendingSize = 0;
+
+    VkCommandPool commandPool = VK_NULL_HANDLE;
+    std::deque<Batch> inFlight;
+    std::vector<VkCommandBuffer> freeCommandBuffers;
+
+    std::vector<PendingCopy> pendingCopies;
+
+    //  Free bytes following head, waits for space when there are none
+    VkDeviceSize reserve();
+
+    //  Gives the space and command buffers of the completed batches back, or of the oldest one after waiting for it
+    void retire(bool wait);
+};